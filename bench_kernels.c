@@ -0,0 +1,306 @@
+/*
+ * In-process microbenchmarks of the bignumber.c kernels: parsing, formatting,
+ * arithmetic, rescaling and whole command handlers, across operand sizes and
+ * for the precision of each arithmetic engine. The module is compiled in with
+ * the few module API functions it needs stubbed, so the numbers are module
+ * CPU only, without networking or the keyspace.
+ *
+ * Usage: ./bench_kernels [iterations [precision ...]]
+ */
+
+#include "bignumber.c"
+
+#include <time.h>
+
+#define BENCH_ROUNDS 5
+
+struct RedisModuleString {
+    const char *ptr;
+    size_t len;
+};
+
+typedef struct {
+    const char *name;
+    const char *a;
+    const char *b;
+} bench_operands_t;
+
+static const bench_operands_t bench_operands[] = {
+    {"small", "12.34", "5.6"},
+    {"18 digits", "123456789.123456789", "987654321.987654321"},
+    {"34 digits", "1234567890123456.789012345678901234",
+     "9876543210987654.321098765432109876"},
+    {"exponent", "1.5e-8", "2.5e+3"},
+    {"60 digits",
+     "123456789012345678901234567890.123456789012345678901234567890",
+     "987654321098765432109876543210.987654321098765432109876543210"},
+};
+
+typedef struct {
+    const bench_operands_t *ops;
+    RedisModuleString str[3];
+    RedisModuleString *argv[3];
+    mpd_t *a;
+    mpd_t *b;
+} bench_case_t;
+
+typedef void (*bench_fn_t)(bench_case_t *c);
+
+/* Keeps the compiler from dropping the work. */
+static volatile size_t bench_sink;
+
+static void *bench_Alloc(size_t bytes) { return malloc(bytes); }
+
+static void *bench_Calloc(size_t nmemb, size_t size) {
+    return calloc(nmemb, size);
+}
+
+static void *bench_Realloc(void *ptr, size_t bytes) {
+    return realloc(ptr, bytes);
+}
+
+static void bench_Free(void *ptr) { free(ptr); }
+
+static void bench_AutoMemory(RedisModuleCtx *ctx) { REDISMODULE_NOT_USED(ctx); }
+
+static const char *bench_StringPtrLen(const RedisModuleString *str,
+                                      size_t *len) {
+    if (len != NULL) {
+        *len = str->len;
+    }
+
+    return str->ptr;
+}
+
+static int bench_StringToLongLong(const RedisModuleString *str,
+                                  long long *ll) {
+    char *end;
+
+    *ll = strtoll(str->ptr, &end, 10);
+
+    return str->len > 0 && end == str->ptr + str->len ? REDISMODULE_OK
+                                                       : REDISMODULE_ERR;
+}
+
+static int bench_ReplyWithStringBuffer(RedisModuleCtx *ctx, const char *buf,
+                                       size_t len) {
+    REDISMODULE_NOT_USED(ctx);
+    bench_sink += len + (unsigned char)buf[0];
+
+    return REDISMODULE_OK;
+}
+
+static int bench_ReplyWithError(RedisModuleCtx *ctx, const char *err) {
+    REDISMODULE_NOT_USED(ctx);
+    fprintf(stderr, "unexpected error reply: %s\n", err);
+    exit(1);
+}
+
+static int bench_WrongArity(RedisModuleCtx *ctx) {
+    return bench_ReplyWithError(ctx, "wrong arity");
+}
+
+static void bench_stub_api(void) {
+    RedisModule_Alloc = bench_Alloc;
+    RedisModule_Calloc = bench_Calloc;
+    RedisModule_Realloc = bench_Realloc;
+    RedisModule_Free = bench_Free;
+    RedisModule_AutoMemory = bench_AutoMemory;
+    RedisModule_StringPtrLen = bench_StringPtrLen;
+    RedisModule_StringToLongLong = bench_StringToLongLong;
+    RedisModule_ReplyWithStringBuffer = bench_ReplyWithStringBuffer;
+    RedisModule_ReplyWithError = bench_ReplyWithError;
+    RedisModule_WrongArity = bench_WrongArity;
+}
+
+static inline RedisModuleString bench_string(const char *s) {
+    RedisModuleString str = {s, strlen(s)};
+
+    return str;
+}
+
+static mpd_t *bench_decimal(const char *s) {
+    mpd_t *dec = mpd_new(&mpd_ctx);
+
+    mpd_set_string(dec, s, &mpd_ctx);
+
+    return dec;
+}
+
+/* The kernels, one call is one operation. The arithmetic ones include
+ * copying the left operand into a scratch decimal. */
+static void bench_parse(bench_case_t *c) {
+    bn_scratch_reset();
+    bench_sink += (size_t)decimal(c->ops->a, strlen(c->ops->a), 0)->digits;
+}
+
+static void bench_format(bench_case_t *c) {
+    char *out;
+
+    bench_sink += bn_format(c->a, &out);
+}
+
+static inline void bench_apply(bench_case_t *c, bn_op_t op) {
+    uint32_t status = 0;
+    mpd_t *res;
+
+    bn_scratch_reset();
+    res = bn_scratch_new();
+    mpd_qcopy(res, c->a, &status);
+    bn_apply(res, c->b, op);
+    bench_sink += (size_t)res->digits;
+}
+
+static void bench_add(bench_case_t *c) { bench_apply(c, op_add); }
+
+static void bench_mul(bench_case_t *c) { bench_apply(c, op_mul); }
+
+static void bench_div(bench_case_t *c) { bench_apply(c, op_div); }
+
+static void bench_rescale(bench_case_t *c) {
+    mpd_t *res;
+
+    bn_scratch_reset();
+    res = bn_scratch_new();
+    bn_rescale(res, c->a, -2);
+    bench_sink += (size_t)res->digits;
+}
+
+static void bench_cmd_add(bench_case_t *c) {
+    c->str[0] = bench_string("bn.add");
+    cmd_ADD(NULL, c->argv, 3);
+}
+
+static void bench_cmd_mul(bench_case_t *c) {
+    c->str[0] = bench_string("bn.mul");
+    cmd_MUL(NULL, c->argv, 3);
+}
+
+static void bench_cmd_to_fixed(bench_case_t *c) {
+    RedisModuleString b = c->str[2];
+
+    c->str[2] = bench_string("2");
+    cmd_TO_FIXED(NULL, c->argv, 3);
+    c->str[2] = b;
+}
+
+static const struct {
+    const char *name;
+    bench_fn_t fn;
+} bench_kernels[] = {
+    {"parse", bench_parse},
+    {"format", bench_format},
+    {"add", bench_add},
+    {"mul", bench_mul},
+    {"div", bench_div},
+    {"rescale", bench_rescale},
+    {"bn.add", bench_cmd_add},
+    {"bn.mul", bench_cmd_mul},
+    {"bn.to_fixed", bench_cmd_to_fixed},
+};
+
+static inline uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Best of BENCH_ROUNDS, in nanoseconds per operation. */
+static double bench_run(bench_fn_t fn, bench_case_t *c, long iterations) {
+    int round;
+    long i;
+    uint64_t start, elapsed, best = UINT64_MAX;
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        start = bench_now();
+        for (i = 0; i < iterations; i++) {
+            fn(c);
+        }
+        elapsed = bench_now() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return (double)best / (double)iterations;
+}
+
+static const char *bench_engine_name(void) {
+    switch (bn_engine) {
+    case bn_engine_word:
+        return "word";
+    case bn_engine_int128:
+        return "int128";
+    default:
+        return "libmpdec";
+    }
+}
+
+static void bench_precision(const char *prec, long iterations) {
+    size_t i, k;
+    const char *err;
+    RedisModuleString value = bench_string(prec);
+    bench_case_t c;
+
+    if (bn_config_set("precision", &value, &err) != REDISMODULE_OK) {
+        fprintf(stderr, "precision %s: %s\n", prec, err);
+        exit(1);
+    }
+
+    printf("\nprecision %s (%s engine), ns/op, best of %d x %ld\n", prec,
+           bench_engine_name(), BENCH_ROUNDS, iterations);
+    printf("%-12s", "kernel");
+    for (i = 0; i < sizeof(bench_operands) / sizeof(bench_operands[0]); i++) {
+        printf("%12s", bench_operands[i].name);
+    }
+    printf("\n");
+
+    for (k = 0; k < sizeof(bench_kernels) / sizeof(bench_kernels[0]); k++) {
+        printf("%-12s", bench_kernels[k].name);
+        for (i = 0; i < sizeof(bench_operands) / sizeof(bench_operands[0]);
+             i++) {
+            c.ops = &bench_operands[i];
+            c.str[0] = bench_string("");
+            c.str[1] = bench_string(c.ops->a);
+            c.str[2] = bench_string(c.ops->b);
+            c.argv[0] = &c.str[0];
+            c.argv[1] = &c.str[1];
+            c.argv[2] = &c.str[2];
+            c.a = bench_decimal(c.ops->a);
+            c.b = bench_decimal(c.ops->b);
+            printf("%12.1f", bench_run(bench_kernels[k].fn, &c, iterations));
+            fflush(stdout);
+            mpd_del(c.a);
+            mpd_del(c.b);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int i;
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    const char *precisions[] = {"18", "34", "50"};
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations [precision ...]]\n", argv[0]);
+        return 1;
+    }
+
+    bench_stub_api();
+    initMPD();
+
+    if (argc > 2) {
+        for (i = 2; i < argc; i++) {
+            bench_precision(argv[i], iterations);
+        }
+    } else {
+        for (i = 0; i < 3; i++) {
+            bench_precision(precisions[i], iterations);
+        }
+    }
+
+    return bench_sink == 0;
+}
@@ -0,0 +1,356 @@
+/*
+ * Pipelined bn.* workloads against a running redis-server with the module
+ * loaded. Requests go out in batches of -P over one connection. The latency
+ * of a request is the time from writing its batch to reading its reply.
+ * Keys are picked from a fixed seed so runs are comparable.
+ *
+ * Usage: ./bench_server [-h host] [-p port] [-n requests] [-P pipeline]
+ *                       [-r keyspace] [-t test,...]
+ */
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_ARGS 16
+#define BENCH_KEY_PREFIX "bench:bn:"
+
+/* A workload is a command template, "__key__" and "__field__" are replaced
+ * by a random key or hash field of the keyspace. */
+typedef struct {
+    const char *name;
+    const char *args[BENCH_MAX_ARGS];
+} bench_test_t;
+
+static const bench_test_t bench_tests[] = {
+    {"add", {"bn.add", "123456789.123456789", "0.000000001", NULL}},
+    {"mul", {"bn.mul", "123456789.123456789", "1.5", NULL}},
+    {"div", {"bn.div", "123456789.123456789", "7", NULL}},
+    {"to_fixed", {"bn.to_fixed", "123456789.123456789", "2", NULL}},
+    {"sum",
+     {"bn.sum", "1.1", "2.2", "3.3", "4.4", "5.5", "6.6", "7.7", "8.8", NULL}},
+    {"set", {"bn.set", "__key__", "1000.00", NULL}},
+    {"incrby", {"bn.incrby", "__key__", "0.01", NULL}},
+    {"cincrby", {"bn.cincrby", "__key__", "0.01", NULL}},
+    {"get", {"bn.get", "__key__", NULL}},
+    {"mincrby",
+     {"bn.mincrby", "__key__", "0.01", "__key__", "0.02", "__key__", "0.03",
+      "__key__", "0.04", NULL}},
+    {"hincrby", {"bn.hincrby", BENCH_KEY_PREFIX "hash", "__field__", "0.01",
+                 NULL}},
+    {"hget", {"bn.hget", BENCH_KEY_PREFIX "hash", "__field__", NULL}},
+};
+
+#define BENCH_TESTS (sizeof(bench_tests) / sizeof(bench_tests[0]))
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+} bench_conn_t;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static int bench_connect(const char *host, const char *port) {
+    int fd, one = 1;
+    struct addrinfo hints, *res, *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "can't resolve %s:%s\n", host, port);
+        exit(1);
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            freeaddrinfo(res);
+            return fd;
+        }
+        close(fd);
+    }
+
+    fprintf(stderr, "can't connect to %s:%s\n", host, port);
+    exit(1);
+}
+
+static void bench_write(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n <= 0) {
+            bench_die("write");
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/* Length of the first complete RESP reply in buf, 0 if more input is
+ * needed. *error is set for error replies. */
+static size_t bench_reply_len(const char *buf, size_t len, int *error) {
+    long i, n;
+    size_t pos, sub;
+    const char *crlf;
+
+    crlf = memchr(buf, '\n', len);
+    if (crlf == NULL) {
+        return 0;
+    }
+    pos = (size_t)(crlf - buf) + 1;
+
+    switch (buf[0]) {
+    case '-':
+        *error = 1;
+        /* fall through */
+    case '+':
+    case ':':
+        return pos;
+    case '$':
+        n = strtol(buf + 1, NULL, 10);
+        if (n < 0) {
+            return pos;
+        }
+        return len >= pos + (size_t)n + 2 ? pos + (size_t)n + 2 : 0;
+    case '*':
+        n = strtol(buf + 1, NULL, 10);
+        for (i = 0; i < n; i++) {
+            sub = bench_reply_len(buf + pos, len - pos, error);
+            if (sub == 0) {
+                return 0;
+            }
+            pos += sub;
+        }
+        return pos;
+    default:
+        fprintf(stderr, "protocol error: %.*s\n", (int)pos, buf);
+        exit(1);
+    }
+}
+
+/* Reads one reply, returns whether it was an error. Only the first error of
+ * each test is printed. */
+static int bench_errors_shown;
+
+static int bench_read_reply(bench_conn_t *conn) {
+    int error = 0;
+    size_t n;
+    ssize_t r;
+
+    for (;;) {
+        if (conn->len > 0) {
+            n = bench_reply_len(conn->buf, conn->len, &error);
+            if (n > 0) {
+                if (error && !bench_errors_shown++) {
+                    fprintf(stderr, "error reply: %.*s", (int)n, conn->buf);
+                }
+                memmove(conn->buf, conn->buf + n, conn->len - n);
+                conn->len -= n;
+                return error;
+            }
+            error = 0;
+        }
+
+        if (conn->size - conn->len < 4096) {
+            conn->size *= 2;
+            conn->buf = realloc(conn->buf, conn->size);
+        }
+
+        r = read(conn->fd, conn->buf + conn->len, conn->size - conn->len);
+        if (r <= 0) {
+            bench_die("read");
+        }
+        conn->len += (size_t)r;
+    }
+}
+
+/* Appends the RESP encoding of one request of the test to out. */
+static size_t bench_format(char *out, const bench_test_t *t, long keyspace) {
+    int argc;
+    char *p = out, tmp[64];
+    const char *arg;
+
+    for (argc = 0; t->args[argc] != NULL; argc++)
+        ;
+
+    p += sprintf(p, "*%d\r\n", argc);
+    for (argc = 0; t->args[argc] != NULL; argc++) {
+        arg = t->args[argc];
+        if (!strcmp(arg, "__key__")) {
+            sprintf(tmp, BENCH_KEY_PREFIX "%ld", random() % keyspace);
+            arg = tmp;
+        } else if (!strcmp(arg, "__field__")) {
+            sprintf(tmp, "field:%ld", random() % keyspace);
+            arg = tmp;
+        }
+        p += sprintf(p, "$%zu\r\n%s\r\n", strlen(arg), arg);
+    }
+
+    return (size_t)(p - out);
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_usec(const uint64_t *lat, long n, double p) {
+    long i = (long)(p * (double)n);
+
+    return (double)lat[i < n ? i : n - 1] / 1000.0;
+}
+
+static void bench_run(bench_conn_t *conn, const bench_test_t *t, long requests,
+                      long pipeline, long keyspace) {
+    long i, j, batch, errors = 0;
+    size_t len;
+    char *out;
+    uint64_t start, sent, *lat;
+
+    out = malloc((size_t)pipeline * 1024);
+    lat = malloc((size_t)requests * sizeof(uint64_t));
+    srandom(1);
+    bench_errors_shown = 0;
+
+    start = bench_now();
+    for (i = 0; i < requests; i += batch) {
+        batch = requests - i < pipeline ? requests - i : pipeline;
+        for (len = 0, j = 0; j < batch; j++) {
+            len += bench_format(out + len, t, keyspace);
+        }
+        sent = bench_now();
+        bench_write(conn->fd, out, len);
+        for (j = 0; j < batch; j++) {
+            errors += bench_read_reply(conn);
+            lat[i + j] = bench_now() - sent;
+        }
+    }
+    start = bench_now() - start;
+
+    qsort(lat, (size_t)requests, sizeof(uint64_t), bench_cmp);
+    printf("%-10s %12.0f %10.1f %10.1f %10.1f %8ld\n", t->name,
+           (double)requests * 1e9 / (double)start,
+           bench_usec(lat, requests, 0.5), bench_usec(lat, requests, 0.99),
+           bench_usec(lat, requests, 0.999), errors);
+    fflush(stdout);
+
+    free(out);
+    free(lat);
+}
+
+/* Drops the keys the write tests created. */
+static void bench_cleanup(bench_conn_t *conn, long keyspace) {
+    long i;
+    char cmd[128], key[64];
+
+    for (i = 0; i <= keyspace; i++) {
+        if (i == keyspace) {
+            strcpy(key, BENCH_KEY_PREFIX "hash");
+        } else {
+            sprintf(key, BENCH_KEY_PREFIX "%ld", i);
+        }
+        sprintf(cmd, "*2\r\n$3\r\nDEL\r\n$%zu\r\n%s\r\n", strlen(key), key);
+        bench_write(conn->fd, cmd, strlen(cmd));
+        bench_read_reply(conn);
+    }
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-h host] [-p port] [-n requests] [-P pipeline] "
+            "[-r keyspace] [-t test,...]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    size_t i;
+    long requests = 100000, pipeline = 16, keyspace = 1000;
+    const char *host = "127.0.0.1", *port = "7379";
+    char *tests = NULL, name[64];
+    bench_conn_t conn;
+
+    while ((opt = getopt(argc, argv, "h:p:n:P:r:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'P':
+            pipeline = atol(optarg);
+            break;
+        case 'r':
+            keyspace = atol(optarg);
+            break;
+        case 't':
+            tests = malloc(strlen(optarg) + 3);
+            sprintf(tests, ",%s,", optarg);
+            break;
+        default:
+            bench_usage(argv[0]);
+        }
+    }
+
+    if (requests <= 0 || pipeline <= 0 || keyspace <= 0) {
+        bench_usage(argv[0]);
+    }
+
+    conn.fd = bench_connect(host, port);
+    conn.size = 65536;
+    conn.len = 0;
+    conn.buf = malloc(conn.size);
+
+    printf("%s:%s, %ld requests, pipeline %ld, keyspace %ld\n", host, port,
+           requests, pipeline, keyspace);
+    printf("%-10s %12s %10s %10s %10s %8s\n", "test", "ops/sec", "p50 us",
+           "p99 us", "p999 us", "errors");
+
+    for (i = 0; i < BENCH_TESTS; i++) {
+        if (tests != NULL) {
+            snprintf(name, sizeof(name), ",%s,", bench_tests[i].name);
+            if (strstr(tests, name) == NULL) {
+                continue;
+            }
+        }
+        bench_run(&conn, &bench_tests[i], requests, pipeline, keyspace);
+    }
+
+    bench_cleanup(&conn, keyspace);
+    close(conn.fd);
+
+    return 0;
+}
@@ -2,15 +2,23 @@
  * Copyright (C) Jinzheng Zhang (tianchaijz)
  */
 
+#define REDISMODULE_EXPERIMENTAL_API
 #include "redismodule.h"
 
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <mpdecimal.h>
 
+#include "bignumber_api.h"
+
 typedef enum {
     op_add = 0,
     op_sub,
@@ -18,416 +26,7099 @@ typedef enum {
     op_div,
 } bn_op_t;
 
+/* Every command: handler (cmd_<name>), command name, flags and key
+ * positions. Registration, the latency wrappers and BN.STATS are generated
+ * from this list. */
+#define BN_COMMANDS(X)                                                         \
+    X(ADD, "bn.add", "readonly fast", 0, 0, 0)                                 \
+    X(SUB, "bn.sub", "readonly fast", 0, 0, 0)                                 \
+    X(MUL, "bn.mul", "readonly fast", 0, 0, 0)                                 \
+    X(DIV, "bn.div", "readonly fast", 0, 0, 0)                                 \
+    X(SUM, "bn.sum", "readonly", 0, 0, 0)                                      \
+    X(PRODUCT, "bn.product", "readonly", 0, 0, 0)                              \
+    X(VADD, "bn.vadd", "readonly", 0, 0, 0)                                    \
+    X(VMUL, "bn.vmul", "readonly", 0, 0, 0)                                    \
+    X(ABS, "bn.abs", "readonly fast", 0, 0, 0)                                 \
+    X(TO_FIXED, "bn.to_fixed", "readonly fast", 0, 0, 0)                       \
+    X(CMP, "bn.cmp", "readonly fast", 0, 0, 0)                                 \
+    X(MIN, "bn.min", "readonly", 0, 0, 0)                                      \
+    X(MAX, "bn.max", "readonly", 0, 0, 0)                                      \
+    X(GET, "bn.get", "readonly", 1, 1, 1)                                      \
+    X(MGET, "bn.mget", "readonly", 2, -1, 1)                                   \
+    X(EVAL, "bn.eval", "readonly getkeys-api", 0, 0, 0)                        \
+    X(WAITUNTIL, "bn.waituntil", "readonly", 1, 1, 1)                          \
+    X(SET, "bn.set", "write deny-oom", 1, 1, 1)                                \
+    X(SETIFGT, "bn.setifgt", "write deny-oom", 1, 1, 1)                        \
+    X(SETIFLT, "bn.setiflt", "write deny-oom", 1, 1, 1)                        \
+    X(CAS, "bn.cas", "write deny-oom", 1, 1, 1)                                \
+    X(INCR, "bn.incr", "write deny-oom", 1, 1, 1)                              \
+    X(DECR, "bn.decr", "write deny-oom", 1, 1, 1)                              \
+    X(INCRBY, "bn.incrby", "write deny-oom", 1, 1, 1)                          \
+    X(DECRBY, "bn.decrby", "write deny-oom", 1, 1, 1)                          \
+    X(IDEM_RECORD, "bn.idem.record", "write deny-oom", 1, 1, 1)                \
+    X(MINCRBY, "bn.mincrby", "write deny-oom", 1, -1, 2)                       \
+    X(TRANSFER, "bn.transfer", "write deny-oom", 1, 2, 1)                      \
+    X(CINCRBY, "bn.cincrby", "write deny-oom", 1, 1, 1)                        \
+    X(CGET, "bn.cget", "readonly", 1, 1, 1)                                    \
+    X(HGET, "bn.hget", "readonly", 1, 1, 1)                                    \
+    X(HMGET, "bn.hmget", "readonly", 1, 1, 1)                                  \
+    X(HINCR, "bn.hincr", "write deny-oom", 1, 1, 1)                            \
+    X(HDECR, "bn.hdecr", "write deny-oom", 1, 1, 1)                            \
+    X(HINCRBY, "bn.hincrby", "write deny-oom", 1, 1, 1)                        \
+    X(HDECRBY, "bn.hdecrby", "write deny-oom", 1, 1, 1)                        \
+    X(HMINCRBY, "bn.hmincrby", "write deny-oom", 1, 1, 1)                      \
+    X(HTRANSFER, "bn.htransfer", "write deny-oom", 1, 1, 1)                    \
+    X(HSUM, "bn.hsum", "readonly", 1, 1, 1)                                    \
+    X(HMIN, "bn.hmin", "readonly", 1, 1, 1)                                    \
+    X(HMAX, "bn.hmax", "readonly", 1, 1, 1)                                    \
+    X(HSETIFGT, "bn.hsetifgt", "write deny-oom", 1, 1, 1)                      \
+    X(HSETIFLT, "bn.hsetiflt", "write deny-oom", 1, 1, 1)                      \
+    X(HCAS, "bn.hcas", "write deny-oom", 1, 1, 1)                              \
+    X(ZADD, "bn.zadd", "write deny-oom", 1, 1, 1)                              \
+    X(ZINCRBY, "bn.zincrby", "write deny-oom", 1, 1, 1)                        \
+    X(ZREM, "bn.zrem", "write", 1, 1, 1)                                       \
+    X(ZSCORE, "bn.zscore", "readonly fast", 1, 1, 1)                           \
+    X(ZCARD, "bn.zcard", "readonly fast", 1, 1, 1)                             \
+    X(ZRANK, "bn.zrank", "readonly fast", 1, 1, 1)                             \
+    X(ZREVRANK, "bn.zrevrank", "readonly fast", 1, 1, 1)                       \
+    X(ZRANGEBYSCORE, "bn.zrangebyscore", "readonly", 1, 1, 1)                  \
+    X(ZREVRANGEBYSCORE, "bn.zrevrangebyscore", "readonly", 1, 1, 1)            \
+    X(LEDGER_APPEND, "bn.ledger.append", "write deny-oom", 1, 1, 1)            \
+    X(LEDGER_BALANCE, "bn.ledger.balance", "readonly", 1, 1, 1)                \
+    X(LEDGER_RANGE, "bn.ledger.range", "readonly", 1, 1, 1)                    \
+    X(TS_ADD, "bn.ts.add", "write deny-oom", 1, 1, 1)                          \
+    X(TS_MERGE, "bn.ts.merge", "write deny-oom", 1, 1, 1)                      \
+    X(TS_RANGE, "bn.ts.range", "readonly", 1, 1, 1)                            \
+    X(CONFIG, "bn.config", "admin", 0, 0, 0)                                   \
+    X(MIGRATE, "bn.migrate", "admin write getkeys-api", 0, 0, 0)               \
+    X(STATS, "bn.stats", "readonly", 0, 0, 0)
+
+typedef enum {
+#define BN_CMD_ENUM(name, ...) bn_cmd_##name,
+    BN_COMMANDS(BN_CMD_ENUM)
+#undef BN_CMD_ENUM
+    bn_cmd_count
+} bn_cmd_t;
+
+static const char *bn_command_names[bn_cmd_count] = {
+#define BN_CMD_NAME(name, cmd, ...) cmd,
+    BN_COMMANDS(BN_CMD_NAME)
+#undef BN_CMD_NAME
+};
+
+/* Native "bignumber" keys keep the decimal in binary form: the coefficient
+ * words, exponent and sign of an mpd_t. Small coefficients live in the inline
+ * words, libmpdec moves them to a dynamic buffer transparently if they grow.
+ * The value is never moved after creation since dec.data may point into it. */
+#define BN_TYPE_NAME "bignumber"
+#define BN_TYPE_ENCVER 0
+#define BN_VALUE_WORDS 4
+
+typedef struct {
+    mpd_t dec;
+    mpd_uint_t data[BN_VALUE_WORDS];
+} bn_value_t;
+
 static mpd_context_t mpd_ctx;
+/* Bumped whenever BN.CONFIG SET changes mpd_ctx, see bn_config_set(). */
+static unsigned long bn_config_gen = 1;
 static mpd_t *mpd_zero;
 static mpd_t *mpd_one;
 
-/* digits: the number of digits to appear after the decimal point. */
-static inline mpd_t *decimal(const char *s, int digits) {
-    mpd_ctx.status = 0;
+static RedisModuleType *bn_type;
+static RedisModuleType *bn_zset_type;
+static RedisModuleType *bn_ledger_type;
+static RedisModuleType *bn_series_type;
+
+/* Per-thread scratch decimals. Each one has preallocated coefficient storage
+ * flagged as static data, sized so that the sum or product of two operands at
+ * the context precision fits without libmpdec allocating. Commands borrow
+ * them with bn_scratch_new() and give them all back with bn_scratch_reset()
+ * on entry, so the steady state makes no allocations at all. The format
+ * buffer is reused the same way. The pool is rebuilt when the precision it
+ * was sized for changes. */
+typedef struct {
+    unsigned long gen;
+    mpd_ssize_t words;
+    size_t used;
+    size_t size;
+    mpd_t **decs;
+    mpd_uint_t **data;
+    char *buf;
+    size_t bufsize;
+} bn_scratch_t;
 
-    mpd_t *dec = mpd_new(&mpd_ctx);
-    mpd_set_string(dec, s, &mpd_ctx);
+static __thread bn_scratch_t bn_scratch;
 
-    if (mpd_ctx.status == MPD_Conversion_syntax) {
-        mpd_del(dec);
-        return NULL;
+static void bn_scratch_init(void) {
+    size_t i;
+    mpd_ssize_t words = (mpd_ctx.prec + MPD_RDIGITS - 1) / MPD_RDIGITS;
+
+    if (bn_scratch.gen != 0) {
+        for (i = 0; i < bn_scratch.size; i++) {
+            RedisModule_Free(bn_scratch.decs[i]);
+            RedisModule_Free(bn_scratch.data[i]);
+        }
+        RedisModule_Free(bn_scratch.decs);
+        RedisModule_Free(bn_scratch.data);
+        RedisModule_Free(bn_scratch.buf);
     }
 
-    if (digits != 0) {
-        mpd_rescale(dec, dec, -digits, &mpd_ctx);
+    bn_scratch.words = 2 * words + 4;
+    bn_scratch.used = 0;
+    bn_scratch.size = 0;
+    bn_scratch.decs = NULL;
+    bn_scratch.data = NULL;
+    bn_scratch.bufsize = 2 * (size_t)mpd_ctx.prec + 64;
+    bn_scratch.buf = RedisModule_Alloc(bn_scratch.bufsize);
+    bn_scratch.gen = bn_config_gen;
+}
+
+static mpd_t *bn_scratch_new(void) {
+    mpd_t *dec;
+    size_t size;
+
+    if (bn_scratch.gen != bn_config_gen) {
+        bn_scratch_init();
+    }
+
+    if (bn_scratch.used == bn_scratch.size) {
+        /* Only grows while warming up, the pool is kept afterwards. */
+        size = bn_scratch.size ? bn_scratch.size * 2 : 8;
+        bn_scratch.decs =
+            RedisModule_Realloc(bn_scratch.decs, size * sizeof(mpd_t *));
+        bn_scratch.data =
+            RedisModule_Realloc(bn_scratch.data, size * sizeof(mpd_uint_t *));
+        for (; bn_scratch.size < size; bn_scratch.size++) {
+            bn_scratch.decs[bn_scratch.size] = RedisModule_Alloc(sizeof(mpd_t));
+            bn_scratch.data[bn_scratch.size] = RedisModule_Alloc(
+                (size_t)bn_scratch.words * sizeof(mpd_uint_t));
+        }
     }
 
+    dec = bn_scratch.decs[bn_scratch.used];
+    dec->flags = MPD_STATIC | MPD_STATIC_DATA;
+    dec->exp = 0;
+    dec->digits = 1;
+    dec->len = 1;
+    dec->alloc = bn_scratch.words;
+    dec->data = bn_scratch.data[bn_scratch.used];
+    dec->data[0] = 0;
+    bn_scratch.used++;
+
     return dec;
 }
 
-static inline int bn_op_helper(RedisModuleCtx *ctx, RedisModuleString **argv,
-                               int argc, bn_op_t op) {
-    size_t len;
-    char *str;
-    const char *val;
-    mpd_t *lhs, *rhs;
-    RedisModuleString *dest;
+static inline size_t bn_scratch_mark(void) { return bn_scratch.used; }
 
-    if (argc != 3) {
-        return RedisModule_WrongArity(ctx);
+/* Returns the scratch decimals borrowed since mark to the pool, dropping
+ * coefficients that outgrew the static storage (e.g. a huge bn.to_fixed). */
+static inline void bn_scratch_release(size_t mark) {
+    size_t i;
+
+    for (i = mark; i < bn_scratch.used; i++) {
+        if (!mpd_isstatic_data(bn_scratch.decs[i])) {
+            mpd_free(bn_scratch.decs[i]->data);
+            bn_scratch.decs[i]->data = bn_scratch.data[i];
+            bn_scratch.decs[i]->flags |= MPD_STATIC_DATA;
+        }
     }
 
-    val = RedisModule_StringPtrLen(argv[1], NULL);
-    lhs = decimal(val, 0);
-    if (lhs == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    bn_scratch.used = mark;
+}
+
+static inline void bn_scratch_reset(void) { bn_scratch_release(0); }
+
+static inline char *bn_scratch_buf(size_t size) {
+    if (bn_scratch.gen != bn_config_gen) {
+        bn_scratch_init();
     }
 
-    val = RedisModule_StringPtrLen(argv[2], NULL);
-    rhs = decimal(val, 0);
-    if (rhs == NULL) {
-        mpd_del(lhs);
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    if (size > bn_scratch.bufsize) {
+        bn_scratch.buf = RedisModule_Realloc(bn_scratch.buf, size);
+        bn_scratch.bufsize = size;
     }
 
-    switch (op) {
-    case op_add:
-        mpd_add(lhs, lhs, rhs, &mpd_ctx);
-        break;
-    case op_sub:
-        mpd_sub(lhs, lhs, rhs, &mpd_ctx);
-        break;
-    case op_mul:
-        mpd_mul(lhs, lhs, rhs, &mpd_ctx);
-        break;
-    case op_div:
-        if (mpd_cmp(rhs, mpd_zero, &mpd_ctx) == 0) {
-            mpd_del(lhs);
-            mpd_del(rhs);
-            return RedisModule_ReplyWithError(ctx, "ERR division by zero");
+    return bn_scratch.buf;
+}
+
+/* Per-command call counts and log-linear latency histograms (8 buckets per
+ * power of two, i.e. within 12.5%), plus counters for the slow paths, see
+ * BN.STATS. Each thread records into its own block without locking, the
+ * blocks are linked together so that BN.STATS can add them up. Reading or
+ * resetting another thread's block is racy, which only ever costs a few
+ * samples. */
+#define BN_HIST_SUB_BITS 3
+#define BN_HIST_SUB (1 << BN_HIST_SUB_BITS)
+#define BN_HIST_MAX_BITS 40 /* ~18 minutes in nanoseconds */
+#define BN_HIST_BUCKETS                                                        \
+    ((BN_HIST_MAX_BITS - BN_HIST_SUB_BITS + 1) * BN_HIST_SUB)
+
+typedef enum {
+    bn_event_mpd_parse = 0,
+    bn_event_mpd_arith,
+    bn_event_mpd_rescale,
+    bn_event_rescale,
+    bn_event_division,
+    bn_event_parse_error,
+    bn_event_offload,
+    bn_event_count
+} bn_event_t;
+
+static const char *bn_event_names[bn_event_count] = {
+    "mpd_parse", "mpd_arith", "mpd_rescale",
+    "rescale",   "division",  "parse_error", "offload"};
+
+typedef struct bn_stats_s {
+    uint64_t calls[bn_cmd_count];
+    uint64_t nanos[bn_cmd_count];
+    uint64_t max[bn_cmd_count];
+    uint64_t hist[bn_cmd_count][BN_HIST_BUCKETS];
+    uint64_t events[bn_event_count];
+    struct bn_stats_s *next;
+} bn_stats_t;
+
+static __thread bn_stats_t *bn_stats_local;
+static bn_stats_t *bn_stats_all;
+static pthread_mutex_t bn_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t bn_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline int bn_hist_index(uint64_t v) {
+    int msb;
+
+    if (v < BN_HIST_SUB) {
+        return (int)v;
+    }
+
+    msb = 63 - __builtin_clzll(v);
+    if (msb >= BN_HIST_MAX_BITS) {
+        msb = BN_HIST_MAX_BITS - 1;
+        v = ((uint64_t)1 << BN_HIST_MAX_BITS) - 1;
+    }
+
+    return (msb - BN_HIST_SUB_BITS + 1) * BN_HIST_SUB +
+           (int)((v >> (msb - BN_HIST_SUB_BITS)) & (BN_HIST_SUB - 1));
+}
+
+/* The highest value that falls into bucket i. */
+static inline uint64_t bn_hist_value(int i) {
+    int msb, shift;
+
+    if (i < BN_HIST_SUB) {
+        return (uint64_t)i;
+    }
+
+    msb = i / BN_HIST_SUB + BN_HIST_SUB_BITS - 1;
+    shift = msb - BN_HIST_SUB_BITS;
+
+    return ((uint64_t)(BN_HIST_SUB + i % BN_HIST_SUB) << shift) +
+           ((uint64_t)1 << shift) - 1;
+}
+
+static inline void bn_stats_event(bn_event_t event) {
+    if (bn_stats_local != NULL) {
+        bn_stats_local->events[event]++;
+    }
+}
+
+static inline uint64_t bn_stats_begin(void) {
+    if (bn_stats_local == NULL) {
+        bn_stats_local = RedisModule_Calloc(1, sizeof(bn_stats_t));
+        pthread_mutex_lock(&bn_stats_lock);
+        bn_stats_local->next = bn_stats_all;
+        bn_stats_all = bn_stats_local;
+        pthread_mutex_unlock(&bn_stats_lock);
+    }
+
+    return bn_now_ns();
+}
+
+static inline void bn_stats_end(bn_cmd_t cmd, uint64_t start) {
+    uint64_t elapsed = bn_now_ns() - start;
+    bn_stats_t *stats = bn_stats_local;
+
+    stats->calls[cmd]++;
+    stats->nanos[cmd] += elapsed;
+    if (elapsed > stats->max[cmd]) {
+        stats->max[cmd] = elapsed;
+    }
+    stats->hist[cmd][bn_hist_index(elapsed)]++;
+}
+
+static const char bn_digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes the n lowest digits of word so that the last one lands at end[-1],
+ * two at a time. */
+static inline void bn_format_word(char *end, mpd_uint_t word, int n) {
+    for (; n >= 2; n -= 2) {
+        end -= 2;
+        memcpy(end, bn_digit_pairs + 2 * (word % 100), 2);
+        word /= 100;
+    }
+
+    if (n) {
+        *--end = (char)('0' + word);
+    }
+}
+
+/* Writes the coefficient digits of a finite decimal, most significant first,
+ * returns the number of digits written (dec->digits). */
+static inline size_t bn_format_coeff(char *p, const mpd_t *dec) {
+    int n;
+    mpd_ssize_t w;
+    char *q = p;
+
+    /* No leading zeros in the most significant word. */
+    n = (int)(dec->digits - (dec->len - 1) * MPD_RDIGITS);
+    bn_format_word(q + n, dec->data[dec->len - 1], n);
+    q += n;
+
+    for (w = dec->len - 2; w >= 0; w--) {
+        bn_format_word(q + MPD_RDIGITS, dec->data[w], MPD_RDIGITS);
+        q += MPD_RDIGITS;
+    }
+
+    return (size_t)(q - p);
+}
+
+/* Formats like mpd_to_sci(dec, 0) into buf, which must have room for
+ * BN_FORMAT_SIZE(dec) bytes. Returns the length, no NUL is written. */
+#define BN_FORMAT_SIZE(dec) ((size_t)(dec)->digits + 32)
+
+static size_t bn_format_to(const mpd_t *dec, char *buf) {
+    size_t n, len;
+    mpd_ssize_t adjexp, ldigits;
+    char *p = buf;
+
+    if (mpd_isnegative(dec)) {
+        *p++ = '-';
+    }
+
+    if (mpd_isspecial(dec)) {
+        if (mpd_isinfinite(dec)) {
+            memcpy(p, "Infinity", 8);
+            p += 8;
+        } else {
+            if (dec->flags & MPD_SNAN) {
+                *p++ = 's';
+            }
+            memcpy(p, "NaN", 3);
+            p += 3;
+            if (dec->len > 0 && !(dec->len == 1 && dec->data[0] == 0)) {
+                p += bn_format_coeff(p, dec);
+            }
         }
-        mpd_div(lhs, lhs, rhs, &mpd_ctx);
-        break;
+        return (size_t)(p - buf);
     }
 
-    len = mpd_to_sci_size(&str, lhs, 0);
-    dest = RedisModule_CreateString(ctx, str, len);
+    n = (size_t)dec->digits;
+    ldigits = dec->digits + dec->exp;
+    adjexp = ldigits - 1;
 
-    free(str);
-    mpd_del(lhs);
-    mpd_del(rhs);
+    if (dec->exp <= 0 && adjexp >= -6) {
+        if (dec->exp == 0) {
+            p += bn_format_coeff(p, dec);
+        } else if (ldigits > 0) {
+            bn_format_coeff(p, dec);
+            memmove(p + ldigits + 1, p + ldigits, n - (size_t)ldigits);
+            p[ldigits] = '.';
+            p += n + 1;
+        } else {
+            *p++ = '0';
+            *p++ = '.';
+            memset(p, '0', (size_t)-ldigits);
+            p += -ldigits;
+            p += bn_format_coeff(p, dec);
+        }
+    } else {
+        bn_format_coeff(p, dec);
+        if (n > 1) {
+            memmove(p + 2, p + 1, n - 1);
+            p[1] = '.';
+            p += n + 1;
+        } else {
+            p += 1;
+        }
+        len = (size_t)sprintf(p, "e%+lld", (long long)adjexp);
+        p += len;
+    }
 
-    return RedisModule_ReplyWithString(ctx, dest);
+    return (size_t)(p - buf);
 }
 
-static inline int bn_get_helper(RedisModuleCtx *ctx, RedisModuleString *hash,
-                                RedisModuleString *key, int digits) {
+/* Same, into the per-thread scratch buffer, which stays valid until the next
+ * call. */
+static inline size_t bn_format(const mpd_t *dec, char **out) {
+    *out = bn_scratch_buf(BN_FORMAT_SIZE(dec));
+
+    return bn_format_to(dec, *out);
+}
+
+static inline int bn_reply_decimal(RedisModuleCtx *ctx, const mpd_t *dec) {
     size_t len;
-    char *buf;
     char *str;
-    const char *val;
-    mpd_t *dec;
-    RedisModuleString *dest;
-    RedisModuleCallReply *reply;
 
-    reply = hash ? RedisModule_Call(ctx, "HGET", "ss", hash, key)
-                 : RedisModule_Call(ctx, "GET", "s", key);
-    if (RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ERROR) {
-        RedisModule_ReplyWithCallReply(ctx, reply);
-        return REDISMODULE_ERR;
+    len = bn_format(dec, &str);
+
+    return RedisModule_ReplyWithStringBuffer(ctx, str, len);
+}
+
+static inline RedisModuleString *bn_decimal_string(RedisModuleCtx *ctx,
+                                                   const mpd_t *dec) {
+    size_t len;
+    char *str;
+
+    len = bn_format(dec, &str);
+
+    return RedisModule_CreateString(ctx, str, len);
+}
+
+/* Fixed-point fast path. A finite decimal with at most 38 coefficient digits
+ * is a scaled unsigned 128-bit integer plus exponent and sign, which is all
+ * that counters and amounts ever need. Additions, subtractions, products and
+ * rescales of such operands are done natively when the exact result still
+ * fits the context (precision, exponent limits), which is exactly when
+ * libmpdec wouldn't round either, so results are bit-identical. Anything
+ * else (overflow, scales too far apart, division, specials) falls back to
+ * libmpdec. Precisions up to one coefficient word use plain 64-bit words
+ * first. */
+typedef enum {
+    bn_engine_mpd = 0,
+    bn_engine_int128,
+    bn_engine_word,
+} bn_engine_t;
+
+/* Picked for the context precision by bn_config_update(). */
+static bn_engine_t bn_engine = bn_engine_mpd;
+
+#if defined(__SIZEOF_INT128__) && MPD_RDIGITS == 19
+#define BN_HAVE_INT128 1
+#define BN_FIXED_DIGITS 38
+
+__extension__ typedef unsigned __int128 bn_u128_t;
+
+typedef struct {
+    bn_u128_t coeff;
+    mpd_ssize_t exp;
+    uint8_t sign;
+} bn_fixed_t;
+
+static bn_u128_t bn_pow10[BN_FIXED_DIGITS + 1];
+
+static void bn_fixed_init(void) {
+    int i;
+
+    bn_pow10[0] = 1;
+    for (i = 1; i <= BN_FIXED_DIGITS; i++) {
+        bn_pow10[i] = bn_pow10[i - 1] * 10;
     }
+}
 
-    val = RedisModule_CallReplyStringPtr(reply, &len);
-    if (val != NULL) {
-        buf = RedisModule_PoolAlloc(ctx, len + 1);
-        memcpy(buf, val, len);
-        buf[len] = '\0';
-        dec = decimal(buf, digits);
-        if (dec == NULL) {
-            return RedisModule_ReplyWithError(ctx,
-                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+/* The fast path is only taken if the context precision fits as well. */
+static inline int bn_fixed_enabled(void) {
+    return bn_engine != bn_engine_mpd;
+}
+
+static inline mpd_ssize_t bn_fixed_digits(bn_u128_t coeff) {
+    mpd_ssize_t n = 1;
+
+    while (n <= BN_FIXED_DIGITS && coeff >= bn_pow10[n]) {
+        n++;
+    }
+
+    return n;
+}
+
+/* Whether libmpdec would store an exact result with this exponent and
+ * number of digits as is: not subnormal and without exponent clamping. */
+static inline int bn_exact_exp(mpd_ssize_t exp, mpd_ssize_t digits,
+                               int zero) {
+    mpd_ssize_t adjexp = exp + digits - 1;
+
+    if (exp < mpd_etiny(&mpd_ctx) || adjexp > mpd_ctx.emax) {
+        return 0;
+    }
+    if (!zero && adjexp < mpd_ctx.emin) {
+        return 0;
+    }
+    if (mpd_ctx.clamp && exp > mpd_etop(&mpd_ctx)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Same, also checking the precision. */
+static inline int bn_fixed_exact(const bn_fixed_t *f) {
+    if (f->coeff >= bn_pow10[mpd_ctx.prec]) {
+        return 0;
+    }
+
+    return bn_exact_exp(f->exp, bn_fixed_digits(f->coeff), f->coeff == 0);
+}
+
+static inline int bn_fixed_from_mpd(bn_fixed_t *f, const mpd_t *dec) {
+    if (mpd_isspecial(dec) || dec->len > 2) {
+        return 0;
+    }
+
+    f->coeff = dec->data[0];
+    if (dec->len == 2) {
+        f->coeff += (bn_u128_t)dec->data[1] * MPD_RADIX;
+    }
+    f->exp = dec->exp;
+    f->sign = mpd_sign(dec);
+
+    return 1;
+}
+
+/* dec keeps its storage flags, two words always fit since MPD_MINALLOC is at
+ * least 2 and both value and scratch decimals have more. */
+static inline void bn_fixed_to_mpd(mpd_t *dec, const bn_fixed_t *f) {
+    dec->data[0] = (mpd_uint_t)(f->coeff % MPD_RADIX);
+    dec->data[1] = (mpd_uint_t)(f->coeff / MPD_RADIX);
+    dec->len = dec->data[1] ? 2 : 1;
+    dec->flags = (uint8_t)((dec->flags & ~(MPD_NEG | MPD_SPECIAL)) | f->sign);
+    dec->exp = f->exp;
+    dec->digits = bn_fixed_digits(f->coeff);
+}
+
+/* Eight ASCII digits at a time, loaded as a little-endian word, see
+ * https://lemire.me/blog/2022/01/21/swar-explained-parsing-eight-digits/ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BN_HAVE_SWAR 1
+
+static inline int bn_swar_is_digits(uint64_t chunk) {
+    return ((chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >>
+             4)) == 0x3333333333333333ULL;
+}
+
+static inline uint64_t bn_swar_parse(uint64_t chunk) {
+    chunk -= 0x3030303030303030ULL;
+    chunk = chunk * 10 + (chunk >> 8);
+    chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+             (((chunk >> 16) & 0x000000FF000000FFULL) *
+              (1 + (10000ULL << 32)))) >>
+            32;
+
+    return chunk;
+}
+#endif
+
+/* Accumulates the run of digits at *p into f->coeff and advances *p past it,
+ * *n counts the coefficient digits. Returns the length of the run, or -1 if
+ * the coefficient would exceed BN_FIXED_DIGITS digits. */
+static inline mpd_ssize_t bn_fixed_parse_run(bn_fixed_t *f, const char **p,
+                                             const char *end, int *n) {
+    const char *s = *p;
+    mpd_ssize_t run;
+#ifdef BN_HAVE_SWAR
+    uint64_t chunk;
+
+    while (end - s >= 8) {
+        memcpy(&chunk, s, 8);
+        if (!bn_swar_is_digits(chunk)) {
+            break;
+        }
+        if ((*n += 8) > BN_FIXED_DIGITS) {
+            return -1;
+        }
+        f->coeff = f->coeff * 100000000 + bn_swar_parse(chunk);
+        s += 8;
+    }
+#endif
+
+    for (; s < end && *s >= '0' && *s <= '9'; s++) {
+        if (++*n > BN_FIXED_DIGITS) {
+            return -1;
         }
+        f->coeff = f->coeff * 10 + (bn_u128_t)(*s - '0');
+    }
+
+    run = s - *p;
+    *p = s;
+
+    return run;
+}
+
+/* Parses [+-]digits[.digits] with at most 38 significant digits, s needn't
+ * be NUL-terminated. Returns 0 for anything else (exponents, specials,
+ * syntax errors), the caller falls back to mpd_qset_string() which handles
+ * and reports those. */
+static inline int bn_fixed_parse(bn_fixed_t *f, const char *s, size_t len) {
+    int n = 0;
+    mpd_ssize_t idigits, run, frac = 0;
+    const char *end = s + len;
 
-        len = mpd_to_sci_size(&str, dec, 0);
-        dest = RedisModule_CreateString(ctx, str, len);
+    f->coeff = 0;
+    f->sign = MPD_POS;
+
+    if (s < end && (*s == '+' || *s == '-')) {
+        f->sign = *s == '-' ? MPD_NEG : MPD_POS;
+        s++;
+    }
 
-        free(str);
-        mpd_del(dec);
+    /* Leading zeros aren't coefficient digits. */
+    for (idigits = 0; s < end && *s == '0'; s++) {
+        idigits++;
+    }
+    if ((run = bn_fixed_parse_run(f, &s, end, &n)) < 0) {
+        return 0;
+    }
+    idigits += run;
 
-        return RedisModule_ReplyWithString(ctx, dest);
+    if (s < end && *s == '.') {
+        s++;
+        if (f->coeff == 0) {
+            for (; s < end && *s == '0'; s++) {
+                frac++;
+            }
+        }
+        if ((run = bn_fixed_parse_run(f, &s, end, &n)) < 0) {
+            return 0;
+        }
+        frac += run;
     }
 
-    return RedisModule_ReplyWithCallReply(ctx, reply);
+    f->exp = -frac;
+
+    return s == end && idigits + frac > 0;
 }
 
-static inline int bn_incr_helper(RedisModuleCtx *ctx, RedisModuleString *hash,
-                                 RedisModuleString *key, mpd_t *delta,
-                                 int incr) {
-    size_t len;
-    char *buf;
-    char *str;
-    const char *val;
-    mpd_t *dec;
-    RedisModuleString *dest;
-    RedisModuleCallReply *reply;
+/* Brings both operands to the smaller exponent, as an exact addition does. */
+static inline int bn_fixed_align(bn_fixed_t *a, bn_fixed_t *b) {
+    mpd_ssize_t shift;
+    bn_fixed_t *hi, *lo;
 
-    reply = hash ? RedisModule_Call(ctx, "HGET", "ss", hash, key)
-                 : RedisModule_Call(ctx, "GET", "s", key);
-    if (RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ERROR) {
-        RedisModule_ReplyWithCallReply(ctx, reply);
-        return REDISMODULE_ERR;
+    if (a->exp == b->exp) {
+        return 1;
     }
 
-    val = RedisModule_CallReplyStringPtr(reply, &len);
-    if (val != NULL) {
-        buf = RedisModule_PoolAlloc(ctx, len + 1);
-        memcpy(buf, val, len);
-        buf[len] = '\0';
-        dec = decimal(buf, 0);
-        if (dec == NULL) {
-            return RedisModule_ReplyWithError(ctx,
-                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+    hi = a->exp > b->exp ? a : b;
+    lo = a->exp > b->exp ? b : a;
+    shift = hi->exp - lo->exp;
+    if (shift > BN_FIXED_DIGITS ||
+        hi->coeff >= bn_pow10[BN_FIXED_DIGITS - shift]) {
+        return 0;
+    }
+
+    hi->coeff *= bn_pow10[shift];
+    hi->exp = lo->exp;
+
+    return 1;
+}
+
+static inline int bn_fixed_add(bn_fixed_t *a, bn_fixed_t b) {
+    if (!bn_fixed_align(a, &b)) {
+        return 0;
+    }
+
+    if (a->sign == b.sign) {
+        /* Both are below 10^38, the sum can't wrap. */
+        a->coeff += b.coeff;
+    } else if (a->coeff >= b.coeff) {
+        a->coeff -= b.coeff;
+        if (a->coeff == 0) {
+            /* Zero from opposite signs is +0, or -0 when rounding to
+             * floor. */
+            a->sign = mpd_ctx.round == MPD_ROUND_FLOOR ? MPD_NEG : MPD_POS;
         }
     } else {
-        dec = mpd_new(&mpd_ctx);
-        mpd_copy(dec, mpd_zero, &mpd_ctx);
+        a->coeff = b.coeff - a->coeff;
+        a->sign = b.sign;
+    }
+
+    return bn_fixed_exact(a);
+}
+
+static inline int bn_fixed_mul(bn_fixed_t *a, const bn_fixed_t *b) {
+    if (__builtin_mul_overflow(a->coeff, b->coeff, &a->coeff)) {
+        return 0;
+    }
+    a->exp += b->exp;
+    a->sign ^= b->sign;
+
+    return bn_fixed_exact(a);
+}
+
+/* Like mpd_qrescale(), which pads or cuts the coefficient regardless of the
+ * precision. Cutting digits is only done here for MPD_ROUND_DOWN. */
+static inline int bn_fixed_rescale(bn_fixed_t *f, mpd_ssize_t exp) {
+    mpd_ssize_t shift;
+
+    if (exp < f->exp) {
+        shift = f->exp - exp;
+        if (shift > BN_FIXED_DIGITS ||
+            f->coeff >= bn_pow10[BN_FIXED_DIGITS - shift]) {
+            return 0;
+        }
+        f->coeff *= bn_pow10[shift];
+    } else if (exp > f->exp) {
+        if (mpd_ctx.round != MPD_ROUND_DOWN || exp > MPD_MAX_EMAX) {
+            return 0;
+        }
+        shift = exp - f->exp;
+        f->coeff = shift > BN_FIXED_DIGITS ? 0 : f->coeff / bn_pow10[shift];
+    }
+    f->exp = exp;
+
+    return 1;
+}
+#endif
+
+#ifdef BN_HAVE_INT128
+/* The single-word path of bn_fixed_apply(), for precisions up to
+ * MPD_RDIGITS where operands and exact results are one coefficient word.
+ * Words that overflow on alignment or multiplication go on to the int128
+ * path. */
+static inline int bn_word_apply(mpd_t *lhs, const mpd_t *rhs, bn_op_t op) {
+    int digits;
+    uint8_t sign, bsign;
+    mpd_uint_t a, b, r;
+    mpd_ssize_t exp, shift;
+
+    if (bn_engine != bn_engine_word || mpd_isspecial(lhs) ||
+        mpd_isspecial(rhs) || lhs->len != 1 || rhs->len != 1) {
+        return 0;
+    }
+
+    a = lhs->data[0];
+    b = rhs->data[0];
+    sign = mpd_sign(lhs);
+    bsign = mpd_sign(rhs);
+    exp = lhs->exp;
+
+    switch (op) {
+    case op_sub:
+        bsign ^= MPD_NEG;
+        /* fall through */
+    case op_add:
+        shift = exp - rhs->exp;
+        if (shift > MPD_RDIGITS || -shift > MPD_RDIGITS) {
+            return 0;
+        } else if (shift > 0) {
+            if (__builtin_mul_overflow(a, (mpd_uint_t)bn_pow10[shift], &a)) {
+                return 0;
+            }
+            exp = rhs->exp;
+        } else if (shift < 0) {
+            if (__builtin_mul_overflow(b, (mpd_uint_t)bn_pow10[-shift], &b)) {
+                return 0;
+            }
+        }
+
+        if (sign == bsign) {
+            if (__builtin_add_overflow(a, b, &r)) {
+                return 0;
+            }
+        } else if (a >= b) {
+            r = a - b;
+            if (r == 0) {
+                sign = mpd_ctx.round == MPD_ROUND_FLOOR ? MPD_NEG : MPD_POS;
+            }
+        } else {
+            r = b - a;
+            sign = bsign;
+        }
+        break;
+    case op_mul:
+        if (__builtin_mul_overflow(a, b, &r)) {
+            return 0;
+        }
+        exp += rhs->exp;
+        sign ^= bsign;
+        break;
+    default:
+        return 0;
+    }
+
+    digits = mpd_word_digits(r);
+    if (digits > mpd_ctx.prec || !bn_exact_exp(exp, digits, r == 0)) {
+        return 0;
+    }
+
+    lhs->data[0] = r;
+    lhs->len = 1;
+    lhs->digits = digits;
+    lhs->exp = exp;
+    lhs->flags = (uint8_t)((lhs->flags & ~(MPD_NEG | MPD_SPECIAL)) | sign);
+
+    return 1;
+}
+#endif
+
+/* lhs = lhs op rhs through the fixed-point path, returns 0 if the operands or
+ * the result don't fit and nothing was written. */
+static inline int bn_fixed_apply(mpd_t *lhs, const mpd_t *rhs, bn_op_t op) {
+#ifdef BN_HAVE_INT128
+    bn_fixed_t a, b;
+
+    if (bn_word_apply(lhs, rhs, op)) {
+        return 1;
+    }
+
+    if (!bn_fixed_enabled() || !bn_fixed_from_mpd(&a, lhs) ||
+        !bn_fixed_from_mpd(&b, rhs)) {
+        return 0;
+    }
+
+    switch (op) {
+    case op_sub:
+        b.sign ^= MPD_NEG;
+        /* fall through */
+    case op_add:
+        if (!bn_fixed_add(&a, b)) {
+            return 0;
+        }
+        break;
+    case op_mul:
+        if (!bn_fixed_mul(&a, &b)) {
+            return 0;
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    bn_fixed_to_mpd(lhs, &a);
+
+    return 1;
+#else
+    REDISMODULE_NOT_USED(lhs);
+    REDISMODULE_NOT_USED(rhs);
+    REDISMODULE_NOT_USED(op);
+
+    return 0;
+#endif
+}
+
+/* res = a rescaled to exp (digits after the decimal point negated), see
+ * mpd_rescale(). res may be a. */
+static inline void bn_rescale(mpd_t *res, const mpd_t *a, mpd_ssize_t exp) {
+#ifdef BN_HAVE_INT128
+    bn_fixed_t f;
+#endif
+
+    bn_stats_event(bn_event_rescale);
+
+#ifdef BN_HAVE_INT128
+    if (bn_fixed_from_mpd(&f, a) && bn_fixed_rescale(&f, exp)) {
+        bn_fixed_to_mpd(res, &f);
+        return;
+    }
+#endif
+
+    bn_stats_event(bn_event_mpd_rescale);
+    mpd_rescale(res, a, exp, &mpd_ctx);
+}
+
+/* Parses the len bytes at s, which needn't be NUL-terminated.
+ * digits: the number of digits to appear after the decimal point.
+ * The result is a scratch decimal, see bn_scratch_new(). */
+static inline mpd_t *decimal(const char *s, size_t len, int digits) {
+    uint32_t status = 0;
+    char *buf;
+#ifdef BN_HAVE_INT128
+    bn_fixed_t f;
+#endif
+
+    mpd_t *dec = bn_scratch_new();
+
+#ifdef BN_HAVE_INT128
+    if (bn_fixed_enabled() && bn_fixed_parse(&f, s, len) &&
+        bn_fixed_exact(&f)) {
+        bn_fixed_to_mpd(dec, &f);
+    } else
+#endif
+    {
+        /* libmpdec wants a C string, only the uncommon inputs pay for the
+         * copy. */
+        bn_stats_event(bn_event_mpd_parse);
+        buf = bn_scratch_buf(len + 1);
+        memcpy(buf, s, len);
+        buf[len] = '\0';
+        mpd_qset_string(dec, buf, &mpd_ctx, &status);
+        if (status & MPD_Conversion_syntax) {
+            bn_stats_event(bn_event_parse_error);
+            return NULL;
+        }
+    }
+
+    if (digits != 0) {
+        bn_rescale(dec, dec, -digits);
+    }
+
+    return dec;
+}
+
+static bn_value_t *bn_value_new(void) {
+    bn_value_t *v = RedisModule_Alloc(sizeof(*v));
+
+    v->dec.flags = MPD_STATIC | MPD_STATIC_DATA;
+    v->dec.exp = 0;
+    v->dec.digits = 1;
+    v->dec.len = 1;
+    v->dec.alloc = BN_VALUE_WORDS;
+    v->dec.data = v->data;
+    v->data[0] = 0;
+
+    return v;
+}
+
+static void bn_value_free(void *value) {
+    bn_value_t *v = value;
+
+    /* Only releases the coefficient if libmpdec made it dynamic. */
+    mpd_del(&v->dec);
+    RedisModule_Free(v);
+}
+
+/* Moves the coefficient back into the inline words after an operation made
+ * libmpdec switch it to a dynamic buffer, if it fits again. */
+static inline void bn_value_compact(bn_value_t *v) {
+    if (mpd_isstatic_data(&v->dec) || v->dec.len > BN_VALUE_WORDS) {
+        return;
+    }
+
+    memcpy(v->data, v->dec.data, (size_t)v->dec.len * sizeof(mpd_uint_t));
+    mpd_free(v->dec.data);
+    v->dec.data = v->data;
+    v->dec.alloc = BN_VALUE_WORDS;
+    v->dec.flags |= MPD_STATIC_DATA;
+}
+
+/* Looks up the native value behind an open key, creating a zero value if the
+ * key is empty. Returns NULL if the key holds another module type. */
+static bn_value_t *bn_value_lookup(RedisModuleKey *rk, int create) {
+    bn_value_t *v;
+
+    if (RedisModule_KeyType(rk) == REDISMODULE_KEYTYPE_EMPTY) {
+        if (!create) {
+            return NULL;
+        }
+        v = bn_value_new();
+        RedisModule_ModuleTypeSetValue(rk, bn_type, v);
+        return v;
+    }
+
+    if (RedisModule_ModuleTypeGetType(rk) != bn_type) {
+        return NULL;
+    }
+
+    return RedisModule_ModuleTypeGetValue(rk);
+}
+
+/* Replicates dec as the value now stored at key, or at a field of the hash
+ * when hash isn't NULL, rather than the command that computed it: replicas
+ * and the AOF then store what this server did whatever their context. A
+ * legacy string key stays one, and like RedisModule_StringSet() SET drops
+ * its TTL. */
+static inline void bn_replicate_value(RedisModuleCtx *ctx,
+                                      RedisModuleString *hash,
+                                      RedisModuleString *key,
+                                      const mpd_t *dec) {
+    int type;
+    size_t len;
+    char *str;
+    RedisModuleKey *rk;
+
+    len = bn_format(dec, &str);
+
+    if (hash != NULL) {
+        RedisModule_Replicate(ctx, "HSET", "ssb", hash, key, str, len);
+        return;
+    }
+
+    rk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
+    type = RedisModule_KeyType(rk);
+    RedisModule_CloseKey(rk);
+
+    if (type == REDISMODULE_KEYTYPE_STRING) {
+        RedisModule_Replicate(ctx, "SET", "sb", key, str, len);
+    } else {
+        RedisModule_Replicate(ctx, "BN.SET", "sbc", key, str, len, "KEEPTTL");
+    }
+}
+
+/* Computes lhs = lhs op rhs. Fails only on division by zero. */
+static inline int bn_apply(mpd_t *lhs, const mpd_t *rhs, bn_op_t op) {
+    if (bn_fixed_apply(lhs, rhs, op)) {
+        return REDISMODULE_OK;
+    }
+
+    bn_stats_event(op == op_div ? bn_event_division : bn_event_mpd_arith);
+
+    switch (op) {
+    case op_add:
+        mpd_add(lhs, lhs, rhs, &mpd_ctx);
+        break;
+    case op_sub:
+        mpd_sub(lhs, lhs, rhs, &mpd_ctx);
+        break;
+    case op_mul:
+        mpd_mul(lhs, lhs, rhs, &mpd_ctx);
+        break;
+    case op_div:
+        if (mpd_cmp(rhs, mpd_zero, &mpd_ctx) == 0) {
+            return REDISMODULE_ERR;
+        }
+        mpd_div(lhs, lhs, rhs, &mpd_ctx);
+        break;
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* Expensive pure arithmetic, huge operands or long divisions, runs on a small
+ * pool of threads so it doesn't stall the event loop. The main thread parses
+ * the arguments into a job and blocks the client, a worker computes and
+ * formats the result, and the reply callback only sends it. A job carries its
+ * own copy of the context, so BN.CONFIG SET can't change it mid-flight. */
+#define BN_WORKERS_MAX 64
+
+typedef struct bn_job_s {
+    bn_op_t op;
+    int argc;
+    mpd_t **argv;
+    mpd_context_t ctx;
+    char *reply;
+    size_t len;
+    RedisModuleBlockedClient *bc;
+    struct bn_job_s *next;
+} bn_job_t;
+
+/* Estimated cost, in coefficient word operations, from which a command is
+ * offloaded (0 disables offloading), and the number of workers. */
+static long long bn_offload_threshold = 4096;
+static long long bn_workers = 2;
+
+static struct {
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bn_job_t *head;
+    bn_job_t *tail;
+} bn_pool = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL,
+             NULL};
+
+/* Folds the operands into argv[0] and formats it. Runs on a worker, so only
+ * libmpdec and the allocator, no module state. */
+static void bn_job_run(bn_job_t *job) {
+    int i;
+    uint32_t status = 0;
+    mpd_t *acc = job->argv[0];
+
+    for (i = 1; i < job->argc; i++) {
+        switch (job->op) {
+        case op_add:
+            mpd_qadd(acc, acc, job->argv[i], &job->ctx, &status);
+            break;
+        case op_sub:
+            mpd_qsub(acc, acc, job->argv[i], &job->ctx, &status);
+            break;
+        case op_mul:
+            mpd_qmul(acc, acc, job->argv[i], &job->ctx, &status);
+            break;
+        case op_div:
+            mpd_qdiv(acc, acc, job->argv[i], &job->ctx, &status);
+            break;
+        }
+    }
+
+    job->reply = RedisModule_Alloc(BN_FORMAT_SIZE(acc));
+    job->len = bn_format_to(acc, job->reply);
+}
+
+static void *bn_worker_main(void *arg) {
+    bn_job_t *job;
+
+    REDISMODULE_NOT_USED(arg);
+
+    for (;;) {
+        pthread_mutex_lock(&bn_pool.lock);
+        while (bn_pool.head == NULL) {
+            pthread_cond_wait(&bn_pool.cond, &bn_pool.lock);
+        }
+        job = bn_pool.head;
+        bn_pool.head = job->next;
+        if (bn_pool.head == NULL) {
+            bn_pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&bn_pool.lock);
+
+        bn_job_run(job);
+        RedisModule_UnblockClient(job->bc, job);
+    }
+
+    return NULL;
+}
+
+/* Started on first use, so a server that never sees a large operand never
+ * pays for the threads. Runs with however many could be created. */
+static int bn_pool_start(void) {
+    long long i;
+    pthread_t tid;
+
+    for (i = 0; i < bn_workers; i++) {
+        if (pthread_create(&tid, NULL, bn_worker_main, NULL) != 0) {
+            break;
+        }
+        pthread_detach(tid);
+    }
+
+    bn_pool.started = i > 0;
+
+    return bn_pool.started ? REDISMODULE_OK : REDISMODULE_ERR;
+}
+
+/* Rough cost of folding the arguments with op, from their lengths alone so
+ * that it's known before parsing. Intermediate results are rounded to the
+ * precision. */
+static long long bn_offload_cost(bn_op_t op, RedisModuleString **argv,
+                                 int argc) {
+    int i;
+    size_t len;
+    long long acc, words, cost = 0;
+    long long prec = (long long)mpd_ctx.prec / MPD_RDIGITS + 1;
+
+    RedisModule_StringPtrLen(argv[0], &len);
+    acc = (long long)len / MPD_RDIGITS + 1;
+
+    for (i = 1; i < argc; i++) {
+        RedisModule_StringPtrLen(argv[i], &len);
+        words = (long long)len / MPD_RDIGITS + 1;
+        switch (op) {
+        case op_add:
+        case op_sub:
+            cost += acc + words;
+            break;
+        case op_mul:
+            cost += acc * words;
+            break;
+        case op_div:
+            cost += (acc + prec) * words;
+            break;
+        }
+        acc = prec;
+    }
+
+    return cost;
+}
+
+/* Whether the command should run on the pool. Clients in MULTI or a script
+ * can't be blocked and always run inline. */
+static int bn_offload_wanted(RedisModuleCtx *ctx, bn_op_t op,
+                             RedisModuleString **argv, int argc) {
+    if (bn_offload_threshold == 0 ||
+        bn_offload_cost(op, argv, argc) < bn_offload_threshold) {
+        return 0;
+    }
+
+    if (RedisModule_GetContextFlags(ctx) &
+        (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA)) {
+        return 0;
+    }
+
+    return bn_pool.started || bn_pool_start() == REDISMODULE_OK;
+}
+
+static bn_job_t *bn_job_new(bn_op_t op, int argc) {
+    bn_job_t *job = RedisModule_Calloc(1, sizeof(*job));
+
+    job->op = op;
+    job->argv = RedisModule_Calloc((size_t)argc, sizeof(mpd_t *));
+    job->ctx = mpd_ctx;
+
+    return job;
+}
+
+/* Scratch decimals don't outlive the command, the job takes a copy. */
+static inline void bn_job_push(bn_job_t *job, const mpd_t *dec) {
+    job->argv[job->argc++] = mpd_qncopy(dec);
+}
+
+static void bn_job_free(RedisModuleCtx *ctx, void *privdata) {
+    int i;
+    bn_job_t *job = privdata;
+
+    REDISMODULE_NOT_USED(ctx);
+
+    for (i = 0; i < job->argc; i++) {
+        mpd_del(job->argv[i]);
+    }
+    RedisModule_Free(job->argv);
+    RedisModule_Free(job->reply);
+    RedisModule_Free(job);
+}
+
+static int bn_job_reply(RedisModuleCtx *ctx, RedisModuleString **argv,
+                        int argc) {
+    bn_job_t *job = RedisModule_GetBlockedClientPrivateData(ctx);
+
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    return RedisModule_ReplyWithStringBuffer(ctx, job->reply, job->len);
+}
+
+static int bn_job_submit(RedisModuleCtx *ctx, bn_job_t *job) {
+    job->bc = RedisModule_BlockClient(ctx, bn_job_reply, NULL, bn_job_free, 0);
+    bn_stats_event(bn_event_offload);
+
+    pthread_mutex_lock(&bn_pool.lock);
+    if (bn_pool.tail != NULL) {
+        bn_pool.tail->next = job;
+    } else {
+        bn_pool.head = job;
+    }
+    bn_pool.tail = job;
+    pthread_cond_signal(&bn_pool.cond);
+    pthread_mutex_unlock(&bn_pool.lock);
+
+    return REDISMODULE_OK;
+}
+
+static inline int bn_op_helper(RedisModuleCtx *ctx, RedisModuleString **argv,
+                               int argc, bn_op_t op) {
+    size_t len;
+    const char *val;
+    mpd_t *lhs, *rhs;
+    bn_job_t *job;
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    val = RedisModule_StringPtrLen(argv[1], &len);
+    lhs = decimal(val, len, 0);
+    if (lhs == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    rhs = decimal(val, len, 0);
+    if (rhs == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (bn_offload_wanted(ctx, op, argv + 1, 2)) {
+        if (op == op_div && mpd_iszero(rhs)) {
+            return RedisModule_ReplyWithError(ctx, "ERR division by zero");
+        }
+        job = bn_job_new(op, 2);
+        bn_job_push(job, lhs);
+        bn_job_push(job, rhs);
+        return bn_job_submit(ctx, job);
+    }
+
+    if (bn_apply(lhs, rhs, op) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR division by zero");
+    }
+
+    return bn_reply_decimal(ctx, lhs);
+}
+
+/* Folds all arguments into the first one, e.g. v1 + v2 + ... + vN, rounding
+ * at each step exactly like the equivalent chain of bn.add calls. */
+static inline int bn_fold_helper(RedisModuleCtx *ctx, RedisModuleString **argv,
+                                 int argc, bn_op_t op) {
+    int i;
+    size_t len, mark;
+    const char *val;
+    mpd_t *acc, *dec;
+    bn_job_t *job;
+
+    if (argc < 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (argc > 2 && bn_offload_wanted(ctx, op, argv + 1, argc - 1)) {
+        job = bn_job_new(op, argc - 1);
+        mark = bn_scratch_mark();
+        for (i = 1; i < argc; i++) {
+            val = RedisModule_StringPtrLen(argv[i], &len);
+            dec = decimal(val, len, 0);
+            if (dec == NULL) {
+                bn_job_free(ctx, job);
+                return RedisModule_ReplyWithError(
+                    ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+            }
+            bn_job_push(job, dec);
+            bn_scratch_release(mark);
+        }
+        return bn_job_submit(ctx, job);
+    }
+
+    val = RedisModule_StringPtrLen(argv[1], &len);
+    acc = decimal(val, len, 0);
+    if (acc == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    mark = bn_scratch_mark();
+    for (i = 2; i < argc; i++) {
+        val = RedisModule_StringPtrLen(argv[i], &len);
+        dec = decimal(val, len, 0);
+        if (dec == NULL) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+        bn_apply(acc, dec, op);
+        bn_scratch_release(mark);
+    }
+
+    return bn_reply_decimal(ctx, acc);
+}
+
+/* argv holds two lists of the same length back to back, x1..xN y1..yN, the
+ * reply is the array of xi op yi. A malformed pair only fails its own
+ * element. */
+static inline int bn_vector_helper(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv, int argc,
+                                   bn_op_t op) {
+    int i, n;
+    size_t len, mark;
+    const char *val;
+    mpd_t *lhs, *rhs;
+
+    if (argc < 3 || (argc - 1) % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    n = (argc - 1) / 2;
+    RedisModule_ReplyWithArray(ctx, n);
+
+    mark = bn_scratch_mark();
+    for (i = 1; i <= n; i++) {
+        val = RedisModule_StringPtrLen(argv[i], &len);
+        lhs = decimal(val, len, 0);
+        val = RedisModule_StringPtrLen(argv[i + n], &len);
+        rhs = decimal(val, len, 0);
+
+        if (lhs == NULL || rhs == NULL) {
+            RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        } else if (bn_apply(lhs, rhs, op) != REDISMODULE_OK) {
+            RedisModule_ReplyWithError(ctx, "ERR division by zero");
+        } else {
+            bn_reply_decimal(ctx, lhs);
+        }
+
+        bn_scratch_release(mark);
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* Fetches the raw string stored at a plain key, or at a hash field when field
+ * isn't NULL, from an open key. *val is set to NULL if there's no value.
+ * Returns REDISMODULE_ERR if the key holds the wrong kind of value. */
+static inline int bn_key_read(RedisModuleKey *rk, RedisModuleString *field,
+                              const char **val, size_t *len) {
+    RedisModuleString *str;
+
+    *val = NULL;
+    *len = 0;
+
+    switch (RedisModule_KeyType(rk)) {
+    case REDISMODULE_KEYTYPE_EMPTY:
+        return REDISMODULE_OK;
+    case REDISMODULE_KEYTYPE_STRING:
+        if (field != NULL) {
+            return REDISMODULE_ERR;
+        }
+        *val = RedisModule_StringDMA(rk, len, REDISMODULE_READ);
+        return REDISMODULE_OK;
+    case REDISMODULE_KEYTYPE_HASH:
+        if (field == NULL) {
+            return REDISMODULE_ERR;
+        }
+        RedisModule_HashGet(rk, REDISMODULE_HASH_NONE, field, &str, NULL);
+        if (str != NULL) {
+            *val = RedisModule_StringPtrLen(str, len);
+        }
+        return REDISMODULE_OK;
+    default:
+        return REDISMODULE_ERR;
+    }
+}
+
+/* Reads the decimal stored at an open key, or at one of its hash fields, and
+ * points *dec at it: the native value itself, or a scratch decimal parsed
+ * from a string. *dec is NULL if there's no value. Returns REDISMODULE_ERR
+ * if the key holds the wrong kind of value or a malformed number. */
+static inline int bn_key_decimal(RedisModuleKey *rk, RedisModuleString *field,
+                                 mpd_t **dec) {
+    size_t len;
+    const char *val;
+    bn_value_t *v;
+
+    *dec = NULL;
+
+    if (field == NULL &&
+        RedisModule_KeyType(rk) == REDISMODULE_KEYTYPE_MODULE) {
+        v = bn_value_lookup(rk, 0);
+        if (v == NULL) {
+            return REDISMODULE_ERR;
+        }
+        *dec = &v->dec;
+        return REDISMODULE_OK;
+    }
+
+    if (bn_key_read(rk, field, &val, &len) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    if (val != NULL) {
+        *dec = decimal(val, len, 0);
+        if (*dec == NULL) {
+            return REDISMODULE_ERR;
+        }
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* Replies with the decimal at an open key, or at one of its hash fields,
+ * rescaled to digits after the decimal point unless digits is 0. */
+static inline int bn_reply_get(RedisModuleCtx *ctx, RedisModuleKey *rk,
+                               RedisModuleString *field, int digits) {
+    mpd_t *dec, *res;
+
+    if (bn_key_decimal(rk, field, &dec) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (dec == NULL) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    if (digits != 0) {
+        res = bn_scratch_new();
+        bn_rescale(res, dec, -digits);
+        return bn_reply_decimal(ctx, res);
+    }
+
+    return bn_reply_decimal(ctx, dec);
+}
+
+static inline int bn_get_helper(RedisModuleCtx *ctx, RedisModuleString *hash,
+                                RedisModuleString *key, int digits) {
+    RedisModuleKey *rk;
+
+    rk = RedisModule_OpenKey(ctx, hash ? hash : key, REDISMODULE_READ);
+
+    return bn_reply_get(ctx, rk, hash ? key : NULL, digits);
+}
+
+/* argv is digits key1 ... keyN, or digits field1 ... fieldN of the hash when
+ * hash isn't NULL. Replies with the array of values, like bn.get would one
+ * at a time. A key of the wrong type only fails its own element. The scratch
+ * decimals of each element go back to the pool before the next one. */
+static inline int bn_mget_helper(RedisModuleCtx *ctx, RedisModuleString *hash,
+                                 RedisModuleString **argv, int argc) {
+    int i;
+    long long digits;
+    size_t mark;
+    RedisModuleKey *rk = NULL;
+
+    if (RedisModule_StringToLongLong(argv[0], &digits) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid digits parameter");
+    }
+
+    if (hash) {
+        rk = RedisModule_OpenKey(ctx, hash, REDISMODULE_READ);
+    }
+
+    RedisModule_ReplyWithArray(ctx, argc - 1);
+
+    mark = bn_scratch_mark();
+    for (i = 1; i < argc; i++) {
+        if (hash) {
+            bn_reply_get(ctx, rk, argv[i], (int)digits);
+        } else {
+            rk = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ);
+            bn_reply_get(ctx, rk, NULL, (int)digits);
+            RedisModule_CloseKey(rk);
+        }
+        bn_scratch_release(mark);
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* The comparisons of BN.WAITUNTIL and the conditional sets, by symbol or by
+ * name. */
+typedef enum {
+    bn_cmp_lt = 0,
+    bn_cmp_le,
+    bn_cmp_eq,
+    bn_cmp_ne,
+    bn_cmp_ge,
+    bn_cmp_gt,
+} bn_cmp_t;
+
+static const char *bn_cmp_symbols[] = {"<", "<=", "==", "!=", ">=", ">"};
+static const char *bn_cmp_names[] = {"lt", "le", "eq", "ne", "ge", "gt"};
+
+/* Returns the bn_cmp_t named by str, or -1. */
+static int bn_cmp_parse(RedisModuleString *str) {
+    int i;
+    const char *s = RedisModule_StringPtrLen(str, NULL);
+
+    for (i = 0; i <= bn_cmp_gt; i++) {
+        if (!strcmp(s, bn_cmp_symbols[i]) || !strcasecmp(s, bn_cmp_names[i])) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Whether c, the result of mpd_cmp(), satisfies op. Comparisons with NaN
+ * never hold. */
+static inline int bn_cmp_holds(int c, bn_cmp_t op) {
+    if (c == INT_MAX) {
+        return 0;
+    }
+
+    switch (op) {
+    case bn_cmp_lt:
+        return c < 0;
+    case bn_cmp_le:
+        return c <= 0;
+    case bn_cmp_eq:
+        return c == 0;
+    case bn_cmp_ne:
+        return c != 0;
+    case bn_cmp_ge:
+        return c >= 0;
+    default:
+        return c > 0;
+    }
+}
+
+/* Identifies a key of the selected db across calls: the db number then the
+ * key name. The buffer is freed with the context. */
+static char *bn_key_id(RedisModuleCtx *ctx, RedisModuleString *key,
+                       size_t *idlen) {
+    int db = RedisModule_GetSelectedDb(ctx);
+    size_t len;
+    const char *name;
+    char *id;
+
+    name = RedisModule_StringPtrLen(key, &len);
+    *idlen = sizeof(db) + len;
+    id = RedisModule_PoolAlloc(ctx, *idlen);
+    memcpy(id, &db, sizeof(db));
+    memcpy(id + sizeof(db), name, len);
+
+    return id;
+}
+
+/* Clients blocked in BN.WAITUNTIL. The waiters of a key form a list whose
+ * head is indexed by key id, so a write only looks at its own key's
+ * waiters. A second dict maps blocked clients back to their waiter for the
+ * timeout and disconnect callbacks. A woken waiter carries the reply to
+ * bn_wait_reply() and is freed with the blocked client. */
+typedef struct bn_waiter_s {
+    struct bn_waiter_s *prev;
+    struct bn_waiter_s *next;
+    RedisModuleBlockedClient *bc;
+    mpd_t *value;
+    bn_cmp_t cmp;
+    char *reply;
+    size_t rlen;
+    size_t idlen;
+    char id[];
+} bn_waiter_t;
+
+static RedisModuleDict *bn_waiters;
+static RedisModuleDict *bn_waiters_bc;
+
+static void bn_waiter_free(bn_waiter_t *w) {
+    mpd_del(w->value);
+    RedisModule_Free(w->reply);
+    RedisModule_Free(w);
+}
+
+static void bn_waiter_unlink(bn_waiter_t *w) {
+    if (w->prev != NULL) {
+        w->prev->next = w->next;
+    } else if (w->next != NULL) {
+        RedisModule_DictReplaceC(bn_waiters, w->id, w->idlen, w->next);
+    } else {
+        RedisModule_DictDelC(bn_waiters, w->id, w->idlen, NULL);
+    }
+
+    if (w->next != NULL) {
+        w->next->prev = w->prev;
+    }
+
+    RedisModule_DictDelC(bn_waiters_bc, &w->bc, sizeof(w->bc), NULL);
+}
+
+/* Wakes the waiters of a key whose condition val now satisfies, val being
+ * the value just written or NULL to read it. A missing key counts as zero,
+ * like for the increments. */
+static void bn_wait_signal(RedisModuleCtx *ctx, RedisModuleString *key,
+                           const mpd_t *val) {
+    size_t idlen, mark;
+    char *id;
+    mpd_t *cur;
+    bn_waiter_t *w, *next;
+    RedisModuleKey *rk;
+
+    if (bn_waiters == NULL || RedisModule_DictSize(bn_waiters) == 0) {
+        return;
+    }
+
+    id = bn_key_id(ctx, key, &idlen);
+    w = RedisModule_DictGetC(bn_waiters, id, idlen, NULL);
+    if (w == NULL) {
+        return;
+    }
+
+    mark = bn_scratch_mark();
+    if (val == NULL) {
+        rk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
+        if (bn_key_decimal(rk, NULL, &cur) != REDISMODULE_OK) {
+            /* Not a number any more, the waiters keep waiting. */
+            RedisModule_CloseKey(rk);
+            bn_scratch_release(mark);
+            return;
+        }
+        RedisModule_CloseKey(rk);
+        val = cur != NULL ? cur : mpd_zero;
+    }
+
+    for (; w != NULL; w = next) {
+        next = w->next;
+        if (bn_cmp_holds(mpd_cmp(val, w->value, &mpd_ctx), w->cmp)) {
+            bn_waiter_unlink(w);
+            w->reply = RedisModule_Alloc(BN_FORMAT_SIZE(val));
+            w->rlen = bn_format_to(val, w->reply);
+            RedisModule_UnblockClient(w->bc, w);
+        }
+    }
+    bn_scratch_release(mark);
+}
+
+/* Catches the writes that don't go through this module: SET, DEL, RENAME,
+ * expiry and eviction. */
+static int bn_wait_notify(RedisModuleCtx *ctx, int type, const char *event,
+                          RedisModuleString *key) {
+    REDISMODULE_NOT_USED(type);
+    REDISMODULE_NOT_USED(event);
+
+    bn_wait_signal(ctx, key, NULL);
+
+    return REDISMODULE_OK;
+}
+
+static int bn_wait_reply(RedisModuleCtx *ctx, RedisModuleString **argv,
+                         int argc) {
+    bn_waiter_t *w = RedisModule_GetBlockedClientPrivateData(ctx);
+
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    return RedisModule_ReplyWithStringBuffer(ctx, w->reply, w->rlen);
+}
+
+static void bn_wait_free(RedisModuleCtx *ctx, void *privdata) {
+    REDISMODULE_NOT_USED(ctx);
+    bn_waiter_free(privdata);
+}
+
+/* Drops the waiter of a client that timed out or went away, the handle is
+ * released with an unblock that has no reply. */
+static void bn_wait_drop(RedisModuleBlockedClient *bc) {
+    bn_waiter_t *w;
+
+    w = RedisModule_DictGetC(bn_waiters_bc, &bc, sizeof(bc), NULL);
+    if (w != NULL) {
+        bn_waiter_unlink(w);
+        bn_waiter_free(w);
+        RedisModule_UnblockClient(bc, NULL);
+    }
+}
+
+static int bn_wait_timeout(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    bn_wait_drop(RedisModule_GetBlockedClientHandle(ctx));
+
+    return RedisModule_ReplyWithNull(ctx);
+}
+
+static void bn_wait_disconnect(RedisModuleCtx *ctx,
+                               RedisModuleBlockedClient *bc) {
+    REDISMODULE_NOT_USED(ctx);
+    bn_wait_drop(bc);
+}
+
+/* argv is key op value timeout. Replies with the value of the key as soon as
+ * it compares to value as op says, or nil after timeout milliseconds (0
+ * waits forever). Scripts and transactions can't block, they get nil right
+ * away if the condition doesn't hold yet. */
+static inline int bn_wait_helper(RedisModuleCtx *ctx, RedisModuleString **argv,
+                                 int argc) {
+    int cmp;
+    long long timeout;
+    size_t len, idlen;
+    const char *val;
+    char *id;
+    mpd_t *dec, *cur;
+    bn_waiter_t *w;
+    RedisModuleKey *rk;
+
+    if (argc != 5) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    cmp = bn_cmp_parse(argv[2]);
+    if (cmp < 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+    }
+
+    val = RedisModule_StringPtrLen(argv[3], &len);
+    dec = decimal(val, len, 0);
+    if (dec == NULL || mpd_isnan(dec)) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (RedisModule_StringToLongLong(argv[4], &timeout) != REDISMODULE_OK ||
+        timeout < 0) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR timeout is not an integer or out of range");
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_key_decimal(rk, NULL, &cur) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (cur == NULL) {
+        cur = mpd_zero;
+    }
+
+    if (bn_cmp_holds(mpd_cmp(cur, dec, &mpd_ctx), cmp)) {
+        return bn_reply_decimal(ctx, cur);
+    }
+
+    if (RedisModule_GetContextFlags(ctx) &
+        (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA)) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    if (bn_waiters == NULL) {
+        bn_waiters = RedisModule_CreateDict(NULL);
+        bn_waiters_bc = RedisModule_CreateDict(NULL);
+    }
+
+    id = bn_key_id(ctx, argv[1], &idlen);
+    w = RedisModule_Calloc(1, sizeof(*w) + idlen);
+    w->value = mpd_qncopy(dec);
+    w->cmp = cmp;
+    w->idlen = idlen;
+    memcpy(w->id, id, idlen);
+
+    w->next = RedisModule_DictGetC(bn_waiters, id, idlen, NULL);
+    if (w->next != NULL) {
+        w->next->prev = w;
+    }
+    RedisModule_DictReplaceC(bn_waiters, w->id, idlen, w);
+
+    w->bc = RedisModule_BlockClient(ctx, bn_wait_reply, bn_wait_timeout,
+                                    bn_wait_free, timeout);
+    RedisModule_DictSetC(bn_waiters_bc, &w->bc, sizeof(w->bc), w);
+    if (RedisModule_SetDisconnectCallback != NULL) {
+        RedisModule_SetDisconnectCallback(w->bc, bn_wait_disconnect);
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* Optional limits on the result of an increment, see bn_bounds_parse(). */
+typedef struct {
+    const mpd_t *min;
+    const mpd_t *max;
+} bn_bounds_t;
+
+/* Returned by bn_incr_apply() when the result would leave the bounds. */
+#define BN_ERR_BOUNDS 2
+
+static inline int bn_in_bounds(const mpd_t *dec, const bn_bounds_t *bounds) {
+    return !mpd_isnan(dec) &&
+           (bounds->min == NULL || mpd_cmp(dec, bounds->min, &mpd_ctx) >= 0) &&
+           (bounds->max == NULL || mpd_cmp(dec, bounds->max, &mpd_ctx) <= 0);
+}
+
+/* Parses the trailing [MIN floor] [MAX ceiling] [IDEMPOTENCY id] arguments
+ * of the increment commands into bounds, whose decimals are scratch ones,
+ * and *idem, NULL without IDEMPOTENCY. On error *err is set to the error
+ * reply. */
+static int bn_bounds_parse(RedisModuleString **argv, int argc,
+                           bn_bounds_t *bounds, RedisModuleString **idem,
+                           const char **err) {
+    int i;
+    size_t len;
+    const char *opt, *val;
+    mpd_t *dec;
+
+    bounds->min = NULL;
+    bounds->max = NULL;
+    *idem = NULL;
+
+    for (i = 0; i + 1 < argc; i += 2) {
+        opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(opt, "idempotency")) {
+            *idem = argv[i + 1];
+            continue;
+        }
+
+        val = RedisModule_StringPtrLen(argv[i + 1], &len);
+
+        dec = decimal(val, len, 0);
+        if (dec == NULL || mpd_isnan(dec)) {
+            *err = REDISMODULE_ERRORMSG_WRONGTYPE;
+            return REDISMODULE_ERR;
+        }
+
+        if (!strcasecmp(opt, "min")) {
+            bounds->min = dec;
+        } else if (!strcasecmp(opt, "max")) {
+            bounds->max = dec;
+        } else {
+            *err = "ERR syntax error";
+            return REDISMODULE_ERR;
+        }
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* Adds delta to (or subtracts it from) the value at key, or at a field of
+ * the hash when hash isn't NULL, and points *res at the new value. New and
+ * native keys are updated in place, legacy string keys written by earlier
+ * versions and hash fields stay decimal strings. Nothing is written if the
+ * key holds the wrong kind of value, or if bounds isn't NULL and the result
+ * would leave them, in which case BN_ERR_BOUNDS is returned and *res points
+ * at the current value. Replication is up to the caller. */
+static inline int bn_incr_apply(RedisModuleCtx *ctx, RedisModuleString *hash,
+                                RedisModuleString *key, const mpd_t *delta,
+                                int incr, const bn_bounds_t *bounds,
+                                mpd_t **res) {
+    uint32_t status = 0;
+    mpd_t *dec, *cur;
+    bn_value_t *v;
+    RedisModuleKey *rk;
+    RedisModuleString *dest;
+
+    rk = RedisModule_OpenKey(ctx, hash ? hash : key,
+                             REDISMODULE_READ | REDISMODULE_WRITE);
+
+    if (hash == NULL) {
+        switch (RedisModule_KeyType(rk)) {
+        case REDISMODULE_KEYTYPE_EMPTY:
+        case REDISMODULE_KEYTYPE_MODULE:
+            v = bn_value_lookup(rk, 0);
+            if (v == NULL &&
+                RedisModule_KeyType(rk) != REDISMODULE_KEYTYPE_EMPTY) {
+                return REDISMODULE_ERR;
+            }
+            if (bounds != NULL) {
+                /* Tried on a copy, the key isn't even created on failure. */
+                dec = bn_scratch_new();
+                if (v != NULL) {
+                    mpd_qcopy(dec, &v->dec, &status);
+                }
+                bn_apply(dec, delta, incr ? op_add : op_sub);
+                if (!bn_in_bounds(dec, bounds)) {
+                    *res = v != NULL ? &v->dec : mpd_zero;
+                    return BN_ERR_BOUNDS;
+                }
+            }
+            if (v == NULL) {
+                v = bn_value_lookup(rk, 1);
+            }
+            if (bounds != NULL) {
+                mpd_qcopy(&v->dec, dec, &status);
+            } else {
+                bn_apply(&v->dec, delta, incr ? op_add : op_sub);
+            }
+            bn_value_compact(v);
+            RedisModule_CloseKey(rk);
+            bn_wait_signal(ctx, key, &v->dec);
+            *res = &v->dec;
+            return REDISMODULE_OK;
+        }
+    }
+
+    if (bn_key_decimal(rk, hash ? key : NULL, &dec) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    if (dec == NULL) {
+        dec = bn_scratch_new();
+    }
+
+    if (bounds != NULL) {
+        cur = dec;
+        dec = bn_scratch_new();
+        mpd_qcopy(dec, cur, &status);
+        bn_apply(dec, delta, incr ? op_add : op_sub);
+        if (!bn_in_bounds(dec, bounds)) {
+            *res = cur;
+            return BN_ERR_BOUNDS;
+        }
+    } else {
+        bn_apply(dec, delta, incr ? op_add : op_sub);
+    }
+
+    dest = bn_decimal_string(ctx, dec);
+
+    if (hash) {
+        RedisModule_HashSet(rk, REDISMODULE_HASH_NONE, key, dest, NULL);
+    } else {
+        RedisModule_StringSet(rk, dest);
+    }
+
+    RedisModule_CloseKey(rk);
+    if (hash == NULL) {
+        bn_wait_signal(ctx, key, dec);
+    }
+    *res = dec;
+
+    return REDISMODULE_OK;
+}
+
+/* Replies to an update that would have left its bounds, with the current
+ * value so the caller can tell how far off it was. */
+static inline int bn_reply_bounds(RedisModuleCtx *ctx, const mpd_t *cur) {
+    size_t len;
+    char *str, *err;
+
+    len = bn_format(cur, &str);
+    err = RedisModule_PoolAlloc(ctx, len + 16);
+    snprintf(err, len + 16, "BNBOUNDS %.*s", (int)len, str);
+
+    return RedisModule_ReplyWithError(ctx, err);
+}
+
+/* Results of increments made with IDEMPOTENCY id, kept for
+ * idempotency-ttl-ms so that a retry replies with the first result instead
+ * of applying the delta again. Entries are indexed by db, key, hash field and
+ * id, and hang off a hashed time wheel by expiry: the wheel only advances
+ * when an IDEMPOTENCY increment comes in, and sweeps the slots of the ticks
+ * elapsed since, skipping entries due on a later lap. Lookups ignore
+ * entries past their expiry that weren't swept yet.
+ *
+ * The table only lives in memory. The Redis 5 module API has no aux fields
+ * to save it in the RDB, so after a restart from an RDB alone it is empty
+ * and a retry of an increment made before the restart is applied again.
+ * Entries are replicated with BN.IDEM.RECORD and their absolute expiry, so
+ * replicas and an AOF replay rebuild it with the master's expiries, and
+ * never decide themselves whether a replayed increment applies. */
+#define BN_IDEM_TICK_MS 1000
+#define BN_IDEM_SLOTS 4096
+#define BN_IDEM_TTL_MAX (30LL * 24 * 3600 * 1000)
+
+typedef struct bn_idem_s {
+    struct bn_idem_s *prev;
+    struct bn_idem_s *next;
+    long long expire;
+    size_t rlen;
+    char *reply;
+    size_t idlen;
+    char id[];
+} bn_idem_t;
+
+static RedisModuleDict *bn_idem;
+static bn_idem_t *bn_idem_wheel[BN_IDEM_SLOTS];
+static long long bn_idem_tick = -1;
+/* idempotency-ttl-ms, not kept across an RDB restart, see above, at most
+ * BN_IDEM_TTL_MAX. Past idempotency-max-entries, the entries due soonest
+ * are dropped to make room, a wheel slot at a time. */
+static long long bn_idem_ttl_ms = 3600000;
+static long long bn_idem_max_entries = 1000000;
+
+static inline bn_idem_t **bn_idem_slot(long long expire) {
+    return &bn_idem_wheel[(expire / BN_IDEM_TICK_MS) % BN_IDEM_SLOTS];
+}
+
+static void bn_idem_free(bn_idem_t *e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        *bn_idem_slot(e->expire) = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    }
+    RedisModule_DictDelC(bn_idem, e->id, e->idlen, NULL);
+    RedisModule_Free(e);
+}
+
+static void bn_idem_expire(long long now) {
+    long long tick = now / BN_IDEM_TICK_MS;
+    bn_idem_t *e, *next;
+
+    if (bn_idem_tick < 0) {
+        bn_idem_tick = tick;
+    } else if (tick - bn_idem_tick > BN_IDEM_SLOTS) {
+        bn_idem_tick = tick - BN_IDEM_SLOTS;
+    }
+
+    for (; bn_idem_tick < tick; bn_idem_tick++) {
+        for (e = bn_idem_wheel[bn_idem_tick % BN_IDEM_SLOTS]; e != NULL;
+             e = next) {
+            next = e->next;
+            if (e->expire <= now) {
+                bn_idem_free(e);
+            }
+        }
+    }
+}
+
+/* Frees the first non-empty slot from the current tick on, which holds the
+ * entries due soonest unless the TTL spans more than a lap of the wheel. */
+static void bn_idem_evict(void) {
+    long long i, tick = bn_idem_tick < 0 ? 0 : bn_idem_tick;
+    bn_idem_t **slot;
+
+    for (i = 0; i < BN_IDEM_SLOTS; i++) {
+        slot = &bn_idem_wheel[(tick + i) % BN_IDEM_SLOTS];
+        if (*slot != NULL) {
+            while (*slot != NULL) {
+                bn_idem_free(*slot);
+            }
+            return;
+        }
+    }
+}
+
+/* The dedup id of an increment of key, or of a field of it when field isn't
+ * NULL: bn_key_id() with lengths, so no two triples collide. */
+static char *bn_idem_id(RedisModuleCtx *ctx, RedisModuleString *key,
+                        RedisModuleString *field, RedisModuleString *idem,
+                        size_t *idlen) {
+    int db = RedisModule_GetSelectedDb(ctx);
+    uint32_t klen32, flen32 = UINT32_MAX;
+    size_t klen, flen = 0, ilen;
+    const char *k, *f = NULL, *i;
+    char *id, *p;
+
+    k = RedisModule_StringPtrLen(key, &klen);
+    if (field != NULL) {
+        f = RedisModule_StringPtrLen(field, &flen);
+        flen32 = (uint32_t)flen;
+    }
+    i = RedisModule_StringPtrLen(idem, &ilen);
+    klen32 = (uint32_t)klen;
+
+    *idlen = sizeof(db) + 2 * sizeof(uint32_t) + klen + flen + ilen;
+    p = id = RedisModule_PoolAlloc(ctx, *idlen);
+    memcpy(p, &db, sizeof(db));
+    p += sizeof(db);
+    memcpy(p, &klen32, sizeof(klen32));
+    p += sizeof(klen32);
+    memcpy(p, k, klen);
+    p += klen;
+    memcpy(p, &flen32, sizeof(flen32));
+    p += sizeof(flen32);
+    if (flen > 0) {
+        memcpy(p, f, flen);
+        p += flen;
+    }
+    memcpy(p, i, ilen);
+
+    return id;
+}
+
+/* The recorded result for id, or NULL. */
+static bn_idem_t *bn_idem_get(const char *id, size_t idlen, long long now) {
+    bn_idem_t *e;
+
+    if (bn_idem == NULL) {
+        return NULL;
+    }
+
+    bn_idem_expire(now);
+
+    e = RedisModule_DictGetC(bn_idem, (void *)id, idlen, NULL);
+    if (e != NULL && e->expire <= now) {
+        bn_idem_free(e);
+        e = NULL;
+    }
+
+    return e;
+}
+
+/* Records reply as the result for id until expire, replacing any entry
+ * already recorded for it. */
+static void bn_idem_put(const char *id, size_t idlen, long long expire,
+                        const char *reply, size_t rlen) {
+    bn_idem_t *e, **slot;
+
+    if (bn_idem == NULL) {
+        bn_idem = RedisModule_CreateDict(NULL);
+    }
+
+    e = RedisModule_DictGetC(bn_idem, (void *)id, idlen, NULL);
+    if (e != NULL) {
+        bn_idem_free(e);
+    }
+
+    while (RedisModule_DictSize(bn_idem) >= (uint64_t)bn_idem_max_entries) {
+        bn_idem_evict();
+    }
+
+    e = RedisModule_Alloc(sizeof(*e) + idlen + rlen);
+    e->expire = expire;
+    e->idlen = idlen;
+    memcpy(e->id, id, idlen);
+    e->reply = e->id + idlen;
+    e->rlen = rlen;
+    memcpy(e->reply, reply, rlen);
+
+    slot = bn_idem_slot(e->expire);
+    e->prev = NULL;
+    e->next = *slot;
+    if (e->next != NULL) {
+        e->next->prev = e;
+    }
+    *slot = e;
+    RedisModule_DictSetC(bn_idem, e->id, idlen, e);
+}
+
+/* Applies an increment and replies with the new value. With an idempotency
+ * id, a retry of an increment already applied replies with the value it
+ * returned then and writes nothing. The entry is replicated with its
+ * expiry as BN.IDEM.RECORD next to the new value, so replicas and the AOF
+ * never decide on their own whether to apply an increment. */
+static inline int bn_incr_helper(RedisModuleCtx *ctx, RedisModuleString *hash,
+                                 RedisModuleString *key, const mpd_t *delta,
+                                 int incr, const bn_bounds_t *bounds,
+                                 RedisModuleString *idem) {
+    int rc;
+    long long now = 0, expire;
+    size_t len, idlen = 0;
+    char *str, *id = NULL;
+    mpd_t *res;
+    bn_idem_t *e;
+
+    if (idem != NULL) {
+        now = RedisModule_Milliseconds();
+        id = bn_idem_id(ctx, hash ? hash : key, hash ? key : NULL, idem,
+                        &idlen);
+        /* What the master sent was applied there, whatever this table
+         * holds. */
+        e = RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_REPLICATED
+                ? NULL
+                : bn_idem_get(id, idlen, now);
+        if (e != NULL) {
+            return RedisModule_ReplyWithStringBuffer(ctx, e->reply, e->rlen);
+        }
+    }
+
+    rc = bn_incr_apply(ctx, hash, key, delta, incr, bounds, &res);
+
+    if (rc == BN_ERR_BOUNDS) {
+        return bn_reply_bounds(ctx, res);
+    }
+
+    if (rc != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    bn_replicate_value(ctx, hash, key, res);
+
+    if (idem != NULL) {
+        expire = now + bn_idem_ttl_ms;
+        len = bn_format(res, &str);
+        bn_idem_put(id, idlen, expire, str, len);
+        if (hash != NULL) {
+            RedisModule_Replicate(ctx, "BN.IDEM.RECORD", "sslbcs", hash, idem,
+                                  expire, str, len, "FIELD", key);
+        } else {
+            RedisModule_Replicate(ctx, "BN.IDEM.RECORD", "sslb", key, idem,
+                                  expire, str, len);
+        }
+    }
+
+    return bn_reply_decimal(ctx, res);
+}
+
+/* Checks that key, or a field of the hash when hash isn't NULL, can take an
+ * increment, without writing anything. */
+static inline int bn_incr_check(RedisModuleCtx *ctx, RedisModuleString *hash,
+                                RedisModuleString *key) {
+    int rc;
+    size_t mark;
+    mpd_t *dec;
+    RedisModuleKey *rk;
+
+    mark = bn_scratch_mark();
+    rk = RedisModule_OpenKey(ctx, hash ? hash : key, REDISMODULE_READ);
+    rc = bn_key_decimal(rk, hash ? key : NULL, &dec);
+    RedisModule_CloseKey(rk);
+    bn_scratch_release(mark);
+
+    return rc;
+}
+
+/* Applies a batch of (key, delta) pairs, or (field, delta) pairs of a single
+ * hash, all or nothing: every delta and every target is validated before
+ * the first write. Deltas are parsed again while applying so the batch size
+ * doesn't grow the scratch pool. The new values are replicated as one
+ * unit. */
+static inline int bn_mincrby_helper(RedisModuleCtx *ctx,
+                                    RedisModuleString *hash,
+                                    RedisModuleString **argv, int argc) {
+    int i;
+    size_t len, mark;
+    const char *val;
+    mpd_t *delta, *res;
+
+    mark = bn_scratch_mark();
+    for (i = 0; i < argc; i += 2) {
+        val = RedisModule_StringPtrLen(argv[i + 1], &len);
+        if (decimal(val, len, 0) == NULL ||
+            bn_incr_check(ctx, hash, argv[i]) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+        bn_scratch_release(mark);
+    }
+
+    RedisModule_ReplyWithArray(ctx, argc / 2);
+
+    for (i = 0; i < argc; i += 2) {
+        val = RedisModule_StringPtrLen(argv[i + 1], &len);
+        delta = decimal(val, len, 0);
+        if (bn_incr_apply(ctx, hash, argv[i], delta, 1, NULL, &res) !=
+            REDISMODULE_OK) {
+            /* Can't happen after the checks above. */
+            RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        } else {
+            bn_replicate_value(ctx, hash, argv[i], res);
+            bn_reply_decimal(ctx, res);
+        }
+        bn_scratch_release(mark);
+    }
+
+    return REDISMODULE_OK;
+}
+
+static inline int bn_incrby_helper(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv, int argc,
+                                   int incr) {
+    size_t len;
+    const char *val, *err;
+    mpd_t *dec;
+    bn_bounds_t bounds;
+    RedisModuleString *delta, *idem;
+
+    if (argc < 3 || (argc - 3) % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (bn_bounds_parse(argv + 3, argc - 3, &bounds, &idem, &err) !=
+        REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, err);
+    }
+
+    delta = argv[2];
+    val = RedisModule_StringPtrLen(delta, &len);
+
+    dec = decimal(val, len, 0);
+    if (dec == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    return bn_incr_helper(ctx, NULL, argv[1], dec, incr,
+                          bounds.min || bounds.max ? &bounds : NULL, idem);
+}
+
+static inline int bn_hincrby_helper(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc,
+                                    int incr) {
+    size_t len;
+    const char *val, *err;
+    mpd_t *dec;
+    bn_bounds_t bounds;
+    RedisModuleString *delta, *idem;
+
+    if (argc < 4 || (argc - 4) % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (bn_bounds_parse(argv + 4, argc - 4, &bounds, &idem, &err) !=
+        REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, err);
+    }
+
+    delta = argv[3];
+    val = RedisModule_StringPtrLen(delta, &len);
+
+    dec = decimal(val, len, 0);
+    if (dec == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    return bn_incr_helper(ctx, argv[1], argv[2], dec, incr,
+                          bounds.min || bounds.max ? &bounds : NULL, idem);
+}
+
+/* Sets the value at key, or at a field of the hash when hash isn't NULL, to
+ * val if the current value passes the test: equal to expected for a
+ * compare-and-set, otherwise val op current, where a missing value always
+ * passes. *set tells whether val was written and *cur points at the value
+ * held afterwards, NULL if there is none. Returns REDISMODULE_ERR if the key
+ * holds the wrong kind of value. */
+static inline int bn_cset_apply(RedisModuleCtx *ctx, RedisModuleString *hash,
+                                RedisModuleString *key, const mpd_t *expected,
+                                bn_cmp_t op, const mpd_t *val, int *set,
+                                const mpd_t **cur) {
+    uint32_t status = 0;
+    mstime_t ttl;
+    mpd_t *dec;
+    bn_value_t *v;
+    RedisModuleKey *rk;
+
+    rk = RedisModule_OpenKey(ctx, hash ? hash : key,
+                             REDISMODULE_READ | REDISMODULE_WRITE);
+    if (bn_key_decimal(rk, hash ? key : NULL, &dec) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    if (expected != NULL) {
+        *set = dec != NULL && mpd_cmp(dec, expected, &mpd_ctx) == 0;
+    } else {
+        *set = dec == NULL || bn_cmp_holds(mpd_cmp(val, dec, &mpd_ctx), op);
+    }
+
+    *cur = dec;
+    if (!*set) {
+        return REDISMODULE_OK;
+    }
+
+    if (hash) {
+        RedisModule_HashSet(rk, REDISMODULE_HASH_NONE, key,
+                            bn_decimal_string(ctx, val), NULL);
+    } else {
+        /* Native values are updated in place. Like BN.SET, a missing or
+         * legacy string key becomes a native one, keeping its TTL. */
+        v = bn_value_lookup(rk, 0);
+        if (v == NULL) {
+            ttl = RedisModule_GetExpire(rk);
+            v = bn_value_new();
+            RedisModule_ModuleTypeSetValue(rk, bn_type, v);
+            if (ttl != REDISMODULE_NO_EXPIRE) {
+                RedisModule_SetExpire(rk, ttl);
+            }
+        }
+        mpd_qcopy(&v->dec, val, &status);
+        bn_value_compact(v);
+        bn_wait_signal(ctx, key, &v->dec);
+    }
+    *cur = val;
+
+    return REDISMODULE_OK;
+}
+
+/* argv is value for BN.SETIFGT and BN.SETIFLT, replied with the value held
+ * afterwards, or expected new for BN.CAS, replied with [1, new] if it
+ * swapped and [0, current] if not. The target is key, or a field of the hash
+ * when hash isn't NULL. Only writes are replicated. */
+static inline int bn_cset_helper(RedisModuleCtx *ctx, RedisModuleString *hash,
+                                 RedisModuleString *key,
+                                 RedisModuleString **argv, int argc,
+                                 bn_cmp_t op) {
+    int i, set;
+    size_t len;
+    const char *val;
+    const mpd_t *cur;
+    mpd_t *dec[2];
+
+    for (i = 0; i < argc; i++) {
+        val = RedisModule_StringPtrLen(argv[i], &len);
+        dec[i] = decimal(val, len, 0);
+        if (dec[i] == NULL) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+    }
+
+    if (bn_cset_apply(ctx, hash, key, argc == 2 ? dec[0] : NULL, op,
+                      dec[argc - 1], &set, &cur) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (set) {
+        bn_replicate_value(ctx, hash, key, cur);
+    }
+
+    if (argc == 2) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithLongLong(ctx, set);
+    }
+
+    return cur != NULL ? bn_reply_decimal(ctx, cur)
+                       : RedisModule_ReplyWithNull(ctx);
+}
+
+/* argv is src dst amount [NONEGATIVE], two plain keys or two fields of the
+ * hash when hash isn't NULL. Both targets are checked before anything is
+ * written, so the debit and the credit happen together or not at all. With
+ * NONEGATIVE the debit is bounded at zero. A transfer to itself writes
+ * nothing. Replies with both new balances, replicated as one command. */
+static inline int bn_transfer_helper(RedisModuleCtx *ctx,
+                                     RedisModuleString *hash,
+                                     RedisModuleString **argv, int argc) {
+    int rc;
+    uint32_t status = 0;
+    size_t len, dlen;
+    const char *val, *dst_name;
+    mpd_t *amount, *src, *dst;
+    bn_bounds_t bounds = {NULL, NULL};
+    RedisModuleKey *rk;
+
+    if (argc == 4) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[3], NULL), "nonegative")) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        bounds.min = mpd_zero;
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    amount = decimal(val, len, 0);
+    if (amount == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (mpd_isspecial(amount) ||
+        (mpd_isnegative(amount) && !mpd_iszero(amount))) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR amount must be a non-negative finite decimal");
+    }
+
+    if (bn_incr_check(ctx, hash, argv[0]) != REDISMODULE_OK ||
+        bn_incr_check(ctx, hash, argv[1]) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    val = RedisModule_StringPtrLen(argv[0], &len);
+    dst_name = RedisModule_StringPtrLen(argv[1], &dlen);
+
+    if (len == dlen && !memcmp(val, dst_name, len)) {
+        rk = RedisModule_OpenKey(ctx, hash ? hash : argv[0], REDISMODULE_READ);
+        bn_key_decimal(rk, hash ? argv[0] : NULL, &src);
+        if (src == NULL) {
+            src = mpd_zero;
+        }
+        dst = bn_scratch_new();
+        mpd_qcopy(dst, src, &status);
+        bn_apply(dst, amount, op_sub);
+        if (!bn_in_bounds(dst, &bounds)) {
+            return bn_reply_bounds(ctx, src);
+        }
+        RedisModule_ReplyWithArray(ctx, 2);
+        bn_reply_decimal(ctx, src);
+        return bn_reply_decimal(ctx, src);
+    }
+
+    rc = bn_incr_apply(ctx, hash, argv[0], amount, 0,
+                       bounds.min != NULL ? &bounds : NULL, &src);
+    if (rc == BN_ERR_BOUNDS) {
+        return bn_reply_bounds(ctx, src);
+    }
+
+    if (rc != REDISMODULE_OK ||
+        bn_incr_apply(ctx, hash, argv[1], amount, 1, NULL, &dst) !=
+            REDISMODULE_OK) {
+        /* Can't happen after the checks above. */
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    bn_replicate_value(ctx, hash, argv[0], src);
+    bn_replicate_value(ctx, hash, argv[1], dst);
+
+    RedisModule_ReplyWithArray(ctx, 2);
+    bn_reply_decimal(ctx, src);
+
+    return bn_reply_decimal(ctx, dst);
+}
+
+typedef enum {
+    bn_agg_sum = 0,
+    bn_agg_min,
+    bn_agg_max,
+} bn_agg_t;
+
+/* argv is hash [digits]. Folds the values of all the fields of the hash into
+ * one decimal, rounding like the equivalent chain of bn.add calls for a sum.
+ * The module API can't iterate a hash, the values are fetched with HVALS.
+ * Replies nil for an empty hash. */
+static inline int bn_hagg_helper(RedisModuleCtx *ctx, RedisModuleString **argv,
+                                 int argc, bn_agg_t agg) {
+    uint32_t status = 0;
+    long long digits;
+    size_t i, n, len, mark;
+    const char *val;
+    mpd_t *acc, *dec, *res;
+    RedisModuleKey *rk;
+    RedisModuleCallReply *reply;
+
+    if (argc < 2 || argc > 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    digits = 0;
+    if (argc == 3) {
+        if (RedisModule_StringToLongLong(argv[2], &digits) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx,
+                                              "ERR invalid digits parameter");
+        }
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    switch (RedisModule_KeyType(rk)) {
+    case REDISMODULE_KEYTYPE_EMPTY:
+        return RedisModule_ReplyWithNull(ctx);
+    case REDISMODULE_KEYTYPE_HASH:
+        break;
+    default:
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    reply = RedisModule_Call(ctx, "HVALS", "s", argv[1]);
+    if (RedisModule_CallReplyType(reply) != REDISMODULE_REPLY_ARRAY ||
+        (n = RedisModule_CallReplyLength(reply)) == 0) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    acc = bn_scratch_new();
+    mark = bn_scratch_mark();
+    for (i = 0; i < n; i++) {
+        val = RedisModule_CallReplyStringPtr(
+            RedisModule_CallReplyArrayElement(reply, i), &len);
+        dec = val != NULL ? decimal(val, len, 0) : NULL;
+        if (dec == NULL) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+
+        /* Seeded with the first value, 0 + x could change its exponent. */
+        if (i == 0) {
+            mpd_qcopy(acc, dec, &status);
+        } else if (agg == bn_agg_sum) {
+            bn_apply(acc, dec, op_add);
+        } else if (agg == bn_agg_min) {
+            mpd_qmin(acc, acc, dec, &mpd_ctx, &status);
+        } else {
+            mpd_qmax(acc, acc, dec, &mpd_ctx, &status);
+        }
+        bn_scratch_release(mark);
+    }
+
+    if (digits != 0) {
+        res = bn_scratch_new();
+        bn_rescale(res, acc, -(int)digits);
+        return bn_reply_decimal(ctx, res);
+    }
+
+    return bn_reply_decimal(ctx, acc);
+}
+
+/* Hot counters, see BN.CINCRBY. Deltas are summed in memory per key and
+ * folded into the stored value by a timer every counter-flush-ms, with one
+ * replicated bn.incrby per key. Until then only BN.CGET sees them. They are
+ * lost if the server stops before the flush, and land on whatever the key
+ * holds at flush time, e.g. they recreate a key deleted in between. */
+typedef struct bn_counter_s {
+    struct bn_counter_s *next;
+    mpd_t *delta;
+    size_t idlen;
+    char id[]; /* See bn_key_id(). */
+} bn_counter_t;
+
+static RedisModuleDict *bn_counters;
+static bn_counter_t *bn_counters_head;
+static int bn_counters_armed;
+static long long bn_counter_flush_ms = 100;
+
+/* Finds the pending counter of a key in the selected db, creating a zero one
+ * if create is set, or returns NULL. */
+static bn_counter_t *bn_counter_lookup(RedisModuleCtx *ctx,
+                                       RedisModuleString *key, int create) {
+    size_t idlen;
+    char *id;
+    bn_counter_t *c;
+
+    if (bn_counters == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        bn_counters = RedisModule_CreateDict(NULL);
+    }
+
+    id = bn_key_id(ctx, key, &idlen);
+
+    c = RedisModule_DictGetC(bn_counters, id, idlen, NULL);
+    if (c != NULL || !create) {
+        return c;
+    }
+
+    c = RedisModule_Alloc(sizeof(*c) + idlen);
+    c->delta = mpd_qnew();
+    mpd_zerocoeff(c->delta);
+    c->idlen = idlen;
+    memcpy(c->id, id, idlen);
+    c->next = bn_counters_head;
+    bn_counters_head = c;
+    RedisModule_DictSetC(bn_counters, c->id, idlen, c);
+
+    return c;
+}
+
+/* The timer callback, writes every pending delta with bn.incrby. A delta
+ * the key can't take any more, e.g. it became a hash, is logged and
+ * dropped. */
+static void bn_counter_flush(RedisModuleCtx *ctx, void *data) {
+    int db;
+    size_t len;
+    char *str;
+    bn_counter_t *c, *next;
+    RedisModuleString *delta;
+    RedisModuleCallReply *reply;
+
+    REDISMODULE_NOT_USED(data);
+
+    for (c = bn_counters_head; c != NULL; c = next) {
+        next = c->next;
+        bn_scratch_reset();
+
+        memcpy(&db, c->id, sizeof(db));
+        len = bn_format(c->delta, &str);
+        /* Owned, bn.incrby reuses the scratch buffer str points into. */
+        delta = RedisModule_CreateString(ctx, str, len);
+        RedisModule_SelectDb(ctx, db);
+        reply = RedisModule_Call(ctx, "bn.incrby", "!bs", c->id + sizeof(db),
+                                 c->idlen - sizeof(db), delta);
+        if (reply == NULL ||
+            RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ERROR) {
+            str = (char *)RedisModule_StringPtrLen(delta, &len);
+            RedisModule_Log(ctx, "warning",
+                            "bn.cincrby: dropped %.*s of key %.*s", (int)len,
+                            str, (int)(c->idlen - sizeof(db)),
+                            c->id + sizeof(db));
+        }
+        if (reply != NULL) {
+            RedisModule_FreeCallReply(reply);
+        }
+        RedisModule_FreeString(ctx, delta);
+
+        mpd_del(c->delta);
+        RedisModule_Free(c);
+    }
+
+    RedisModule_FreeDict(NULL, bn_counters);
+    bn_counters = NULL;
+    bn_counters_head = NULL;
+    bn_counters_armed = 0;
+}
+
+/* Replies with the stored value of a key plus its pending delta, or nil if
+ * there's neither. */
+static inline int bn_reply_counter(RedisModuleCtx *ctx, RedisModuleString *key,
+                                   int digits) {
+    uint32_t status = 0;
+    mpd_t *dec, *res;
+    bn_counter_t *c;
+    RedisModuleKey *rk;
+
+    rk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
+    if (bn_key_decimal(rk, NULL, &dec) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    c = bn_counter_lookup(ctx, key, 0);
+    if (dec == NULL && c == NULL) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    res = bn_scratch_new();
+    if (dec != NULL) {
+        mpd_qcopy(res, dec, &status);
+    }
+    if (c != NULL) {
+        bn_apply(res, c->delta, op_add);
+    }
+    if (digits != 0) {
+        bn_rescale(res, res, -digits);
+    }
+
+    return bn_reply_decimal(ctx, res);
+}
+
+/* BN.EVAL compiles an arithmetic expression into a plan, a short program
+ * for a stack machine that only works on binary decimals:
+ *
+ *   expr    = term { ("+" | "-") term }
+ *   term    = unary { ("*" | "/") unary }
+ *   unary   = ("-" | "+") unary | primary
+ *   primary = number | "KEYS[" n "]" | "ARGV[" n "]" | "(" expr ")"
+ *
+ * Plans are cached by expression text, keys and arguments are bound at each
+ * call. Every step rounds like the equivalent bn.add, bn.sub, bn.mul or
+ * bn.div call would. */
+#define BN_EVAL_MAX_LEN 4096
+#define BN_EVAL_MAX_NESTING 64
+#define BN_EVAL_MAX_INDEX 65536
+#define BN_EVAL_CACHE_MAX 1024
+
+typedef enum {
+    bn_insn_const = 0,
+    bn_insn_key,
+    bn_insn_arg,
+    bn_insn_neg,
+    bn_insn_apply,
+} bn_insn_op_t;
+
+typedef struct {
+    bn_insn_op_t op;
+    uint32_t arg; /* The operand index, or the bn_op_t of bn_insn_apply. */
+} bn_insn_t;
+
+typedef struct bn_plan_s {
+    struct bn_plan_s *next;
+    unsigned long gen; /* The bn_config_gen the constants were parsed for. */
+    uint32_t depth;    /* Stack slots needed. */
+    uint32_t nkeys;    /* Highest n of KEYS[n] and ARGV[n]. */
+    uint32_t nargs;
+    uint32_t nconsts;
+    uint32_t len;
+    mpd_t **consts;
+    bn_insn_t *code;
+} bn_plan_t;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int nesting;
+    uint32_t sp;
+    uint32_t cap;
+    bn_plan_t *plan;
+} bn_parser_t;
+
+static RedisModuleDict *bn_plans;
+static bn_plan_t *bn_plans_head;
+
+static void bn_plan_clear(bn_plan_t *plan) {
+    uint32_t i;
+
+    for (i = 0; i < plan->nconsts; i++) {
+        mpd_del(plan->consts[i]);
+    }
+    RedisModule_Free(plan->consts);
+    RedisModule_Free(plan->code);
+}
+
+static void bn_plan_free(bn_plan_t *plan) {
+    bn_plan_clear(plan);
+    RedisModule_Free(plan);
+}
+
+static void bn_plan_emit(bn_parser_t *ps, bn_insn_op_t op, uint32_t arg) {
+    bn_plan_t *plan = ps->plan;
+
+    if (plan->len == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 16;
+        plan->code =
+            RedisModule_Realloc(plan->code, ps->cap * sizeof(bn_insn_t));
+    }
+
+    plan->code[plan->len].op = op;
+    plan->code[plan->len].arg = arg;
+    plan->len++;
+
+    if (op == bn_insn_apply) {
+        ps->sp--;
+    } else if (op != bn_insn_neg && ++ps->sp > plan->depth) {
+        plan->depth = ps->sp;
+    }
+}
+
+static inline void bn_parser_skip(bn_parser_t *ps) {
+    while (ps->p < ps->end && isspace((unsigned char)*ps->p)) {
+        ps->p++;
+    }
+}
+
+/* Whether the input continues with c, which is then consumed. */
+static inline int bn_parser_accept(bn_parser_t *ps, char c) {
+    bn_parser_skip(ps);
+    if (ps->p < ps->end && *ps->p == c) {
+        ps->p++;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int bn_parse_expr(bn_parser_t *ps);
+
+/* KEYS[n] or ARGV[n], name includes the bracket. */
+static int bn_parse_ref(bn_parser_t *ps, const char *name, bn_insn_op_t op) {
+    size_t len = strlen(name);
+    uint32_t n = 0, *max;
+
+    if ((size_t)(ps->end - ps->p) < len || strncasecmp(ps->p, name, len)) {
+        return REDISMODULE_ERR;
+    }
+
+    ps->p += len;
+    bn_parser_skip(ps);
+    while (ps->p < ps->end && isdigit((unsigned char)*ps->p)) {
+        n = n * 10 + (uint32_t)(*ps->p++ - '0');
+        if (n > BN_EVAL_MAX_INDEX) {
+            return REDISMODULE_ERR;
+        }
+    }
+
+    if (n == 0 || !bn_parser_accept(ps, ']')) {
+        return REDISMODULE_ERR;
+    }
+
+    max = op == bn_insn_key ? &ps->plan->nkeys : &ps->plan->nargs;
+    if (n > *max) {
+        *max = n;
+    }
+    bn_plan_emit(ps, op, n - 1);
+
+    return REDISMODULE_OK;
+}
+
+static int bn_parse_number(bn_parser_t *ps) {
+    const char *start = ps->p;
+    mpd_t *dec;
+    bn_plan_t *plan = ps->plan;
+
+    while (ps->p < ps->end &&
+           (isdigit((unsigned char)*ps->p) || *ps->p == '.')) {
+        ps->p++;
+    }
+    if (ps->p < ps->end && (*ps->p == 'e' || *ps->p == 'E')) {
+        ps->p++;
+        if (ps->p < ps->end && (*ps->p == '+' || *ps->p == '-')) {
+            ps->p++;
+        }
+        while (ps->p < ps->end && isdigit((unsigned char)*ps->p)) {
+            ps->p++;
+        }
+    }
+
+    dec = decimal(start, (size_t)(ps->p - start), 0);
+    if (dec == NULL) {
+        return REDISMODULE_ERR;
+    }
+
+    plan->consts = RedisModule_Realloc(
+        plan->consts, (plan->nconsts + 1) * sizeof(mpd_t *));
+    plan->consts[plan->nconsts] = mpd_qncopy(dec);
+    bn_plan_emit(ps, bn_insn_const, plan->nconsts++);
+
+    return REDISMODULE_OK;
+}
+
+static int bn_parse_unary(bn_parser_t *ps) {
+    int rc;
+
+    if (++ps->nesting > BN_EVAL_MAX_NESTING) {
+        return REDISMODULE_ERR;
+    }
+
+    bn_parser_skip(ps);
+    if (ps->p == ps->end) {
+        return REDISMODULE_ERR;
+    }
+
+    switch (*ps->p) {
+    case '-':
+        ps->p++;
+        rc = bn_parse_unary(ps);
+        bn_plan_emit(ps, bn_insn_neg, 0);
+        break;
+    case '+':
+        ps->p++;
+        rc = bn_parse_unary(ps);
+        break;
+    case '(':
+        ps->p++;
+        rc = bn_parse_expr(ps);
+        if (rc == REDISMODULE_OK && !bn_parser_accept(ps, ')')) {
+            rc = REDISMODULE_ERR;
+        }
+        break;
+    case 'K':
+    case 'k':
+        rc = bn_parse_ref(ps, "keys[", bn_insn_key);
+        break;
+    case 'A':
+    case 'a':
+        rc = bn_parse_ref(ps, "argv[", bn_insn_arg);
+        break;
+    default:
+        rc = bn_parse_number(ps);
+    }
+
+    ps->nesting--;
+
+    return rc;
+}
+
+static int bn_parse_term(bn_parser_t *ps) {
+    bn_op_t op;
+
+    if (bn_parse_unary(ps) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    for (;;) {
+        if (bn_parser_accept(ps, '*')) {
+            op = op_mul;
+        } else if (bn_parser_accept(ps, '/')) {
+            op = op_div;
+        } else {
+            return REDISMODULE_OK;
+        }
+        if (bn_parse_unary(ps) != REDISMODULE_OK) {
+            return REDISMODULE_ERR;
+        }
+        bn_plan_emit(ps, bn_insn_apply, op);
+    }
+}
+
+static int bn_parse_expr(bn_parser_t *ps) {
+    bn_op_t op;
+
+    if (bn_parse_term(ps) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    for (;;) {
+        if (bn_parser_accept(ps, '+')) {
+            op = op_add;
+        } else if (bn_parser_accept(ps, '-')) {
+            op = op_sub;
+        } else {
+            return REDISMODULE_OK;
+        }
+        if (bn_parse_term(ps) != REDISMODULE_OK) {
+            return REDISMODULE_ERR;
+        }
+        bn_plan_emit(ps, bn_insn_apply, op);
+    }
+}
+
+/* Returns the cached plan of an expression, compiling it on a miss or when
+ * the context changed since. NULL if it doesn't parse. */
+static bn_plan_t *bn_plan_get(RedisModuleString *expr) {
+    int rc;
+    size_t len;
+    const char *s;
+    bn_plan_t *plan, *old, *next;
+    bn_parser_t ps;
+
+    s = RedisModule_StringPtrLen(expr, &len);
+
+    if (bn_plans == NULL) {
+        bn_plans = RedisModule_CreateDict(NULL);
+    }
+
+    old = RedisModule_DictGetC(bn_plans, (void *)s, len, NULL);
+    if (old != NULL && old->gen == bn_config_gen) {
+        return old;
+    }
+
+    if (len > BN_EVAL_MAX_LEN) {
+        return NULL;
+    }
+
+    memset(&ps, 0, sizeof(ps));
+    ps.p = s;
+    ps.end = s + len;
+    ps.plan = plan = RedisModule_Calloc(1, sizeof(*plan));
+    plan->gen = bn_config_gen;
+
+    rc = bn_parse_expr(&ps);
+    bn_parser_skip(&ps);
+    if (rc != REDISMODULE_OK || ps.p != ps.end) {
+        bn_plan_free(plan);
+        return NULL;
+    }
+
+    if (old != NULL) {
+        /* Recompiled for a new context, takes over the old slot. */
+        next = old->next;
+        bn_plan_clear(old);
+        *old = *plan;
+        old->next = next;
+        RedisModule_Free(plan);
+        return old;
+    }
+
+    if (RedisModule_DictSize(bn_plans) >= BN_EVAL_CACHE_MAX) {
+        for (old = bn_plans_head; old != NULL; old = next) {
+            next = old->next;
+            bn_plan_free(old);
+        }
+        RedisModule_FreeDict(NULL, bn_plans);
+        bn_plans = RedisModule_CreateDict(NULL);
+        bn_plans_head = NULL;
+    }
+
+    plan->next = bn_plans_head;
+    bn_plans_head = plan;
+    RedisModule_DictSetC(bn_plans, (void *)s, len, plan);
+
+    return plan;
+}
+
+/* argv is expr nkeys key1 ... keyN arg1 ... argM. Keys are read like bn.get
+ * reads them, the reply is nil if one the plan uses has no value. */
+static inline int bn_eval_helper(RedisModuleCtx *ctx, RedisModuleString **argv,
+                                 int argc) {
+    uint32_t i, sp, n, status = 0;
+    long long nkeys;
+    size_t len;
+    const char *val;
+    mpd_t **stack, **keys, **args;
+    bn_plan_t *plan;
+    RedisModuleKey *rk;
+
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (RedisModule_StringToLongLong(argv[2], &nkeys) != REDISMODULE_OK ||
+        nkeys < 0 || nkeys > argc - 3) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid number of keys");
+    }
+
+    plan = bn_plan_get(argv[1]);
+    if (plan == NULL) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid expression");
+    }
+
+    if (plan->nkeys > nkeys || plan->nargs > argc - 3 - nkeys) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR expression uses more keys or arguments than given");
+    }
+
+    n = plan->depth + plan->nkeys + plan->nargs;
+    stack = RedisModule_PoolAlloc(ctx, n * sizeof(mpd_t *));
+    memset(stack, 0, n * sizeof(mpd_t *));
+    keys = stack + plan->depth;
+    args = keys + plan->nkeys;
+
+    for (i = 0; i < plan->depth; i++) {
+        stack[i] = bn_scratch_new();
+    }
+
+    for (i = 0, sp = 0; i < plan->len; i++) {
+        n = plan->code[i].arg;
+        switch (plan->code[i].op) {
+        case bn_insn_const:
+            mpd_qcopy(stack[sp++], plan->consts[n], &status);
+            break;
+        case bn_insn_key:
+            if (keys[n] == NULL) {
+                rk = RedisModule_OpenKey(ctx, argv[3 + n], REDISMODULE_READ);
+                if (bn_key_decimal(rk, NULL, &keys[n]) != REDISMODULE_OK) {
+                    return RedisModule_ReplyWithError(
+                        ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+                }
+                if (keys[n] == NULL) {
+                    return RedisModule_ReplyWithNull(ctx);
+                }
+            }
+            mpd_qcopy(stack[sp++], keys[n], &status);
+            break;
+        case bn_insn_arg:
+            if (args[n] == NULL) {
+                val = RedisModule_StringPtrLen(argv[3 + nkeys + n], &len);
+                args[n] = decimal(val, len, 0);
+                if (args[n] == NULL) {
+                    return RedisModule_ReplyWithError(
+                        ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+                }
+            }
+            mpd_qcopy(stack[sp++], args[n], &status);
+            break;
+        case bn_insn_neg:
+            mpd_qminus(stack[sp - 1], stack[sp - 1], &mpd_ctx, &status);
+            break;
+        case bn_insn_apply:
+            sp--;
+            if (bn_apply(stack[sp - 1], stack[sp], (bn_op_t)n) !=
+                REDISMODULE_OK) {
+                return RedisModule_ReplyWithError(ctx, "ERR division by zero");
+            }
+            break;
+        }
+    }
+
+    return bn_reply_decimal(ctx, stack[0]);
+}
+
+int cmd_ADD(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_op_helper(ctx, argv, argc, op_add);
+}
+
+int cmd_SUB(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_op_helper(ctx, argv, argc, op_sub);
+}
+
+int cmd_MUL(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_op_helper(ctx, argv, argc, op_mul);
+}
+
+int cmd_DIV(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_op_helper(ctx, argv, argc, op_div);
+}
+
+int cmd_SUM(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_fold_helper(ctx, argv, argc, op_add);
+}
+
+int cmd_PRODUCT(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_fold_helper(ctx, argv, argc, op_mul);
+}
+
+int cmd_VADD(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_vector_helper(ctx, argv, argc, op_add);
+}
+
+int cmd_VMUL(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_vector_helper(ctx, argv, argc, op_mul);
+}
+
+int cmd_ABS(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    size_t len;
+    const char *val;
+    mpd_t *dec;
+
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    val = RedisModule_StringPtrLen(argv[1], &len);
+    dec = decimal(val, len, 0);
+    if (dec == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    mpd_abs(dec, dec, &mpd_ctx);
+
+    return bn_reply_decimal(ctx, dec);
+}
+
+int cmd_TO_FIXED(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    long long digits;
+    size_t len;
+    const char *val;
+    mpd_t *dec;
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (RedisModule_StringToLongLong(argv[2], &digits) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid digits parameter");
+    }
+
+    val = RedisModule_StringPtrLen(argv[1], &len);
+    dec = decimal(val, len, 0);
+    if (dec == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    bn_rescale(dec, dec, -(int)digits);
+
+    return bn_reply_decimal(ctx, dec);
+}
+
+/* BN.CMP a b, -1, 0 or 1 as a is less than, equal to or greater than b, nil
+ * if either is NaN. */
+int cmd_CMP(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i, c;
+    size_t len;
+    const char *val;
+    mpd_t *dec[2];
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    for (i = 0; i < 2; i++) {
+        val = RedisModule_StringPtrLen(argv[1 + i], &len);
+        dec[i] = decimal(val, len, 0);
+        if (dec[i] == NULL) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+    }
+
+    c = mpd_cmp(dec[0], dec[1], &mpd_ctx);
+    if (c == INT_MAX) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    return RedisModule_ReplyWithLongLong(ctx, c);
+}
+
+/* BN.MIN and BN.MAX of one or more numbers. Like BN.HMIN and BN.HMAX, NaNs
+ * are ignored unless all of them are. */
+static inline int bn_minmax_helper(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv, int argc,
+                                   int max) {
+    uint32_t status = 0;
+    int i;
+    size_t len, mark;
+    const char *val;
+    mpd_t *acc, *dec;
+
+    if (argc < 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    acc = bn_scratch_new();
+    mark = bn_scratch_mark();
+    for (i = 1; i < argc; i++) {
+        val = RedisModule_StringPtrLen(argv[i], &len);
+        dec = decimal(val, len, 0);
+        if (dec == NULL) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+
+        if (i == 1) {
+            mpd_qcopy(acc, dec, &status);
+        } else if (max) {
+            mpd_qmax(acc, acc, dec, &mpd_ctx, &status);
+        } else {
+            mpd_qmin(acc, acc, dec, &mpd_ctx, &status);
+        }
+        bn_scratch_release(mark);
+    }
+
+    return bn_reply_decimal(ctx, acc);
+}
+
+int cmd_MIN(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_minmax_helper(ctx, argv, argc, 0);
+}
+
+int cmd_MAX(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_minmax_helper(ctx, argv, argc, 1);
+}
+
+int cmd_GET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    long long digits;
+
+    if (argc < 2 || argc > 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    digits = 0;
+    if (argc == 3) {
+        if (RedisModule_StringToLongLong(argv[2], &digits) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx,
+                                              "ERR invalid digits parameter");
+        }
+    }
+
+    return bn_get_helper(ctx, NULL, argv[1], (int)digits);
+}
+
+/* BN.MGET digits key [key ...] */
+int cmd_MGET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_mget_helper(ctx, NULL, argv + 1, argc - 1);
+}
+
+/* BN.EVAL expr nkeys [key ...] [arg ...] */
+int cmd_EVAL(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i;
+    long long nkeys;
+
+    if (RedisModule_IsKeysPositionRequest(ctx)) {
+        if (argc >= 3 &&
+            RedisModule_StringToLongLong(argv[2], &nkeys) == REDISMODULE_OK &&
+            nkeys >= 0 && nkeys <= argc - 3) {
+            for (i = 0; i < nkeys; i++) {
+                RedisModule_KeyAtPos(ctx, 3 + i);
+            }
+        }
+        return REDISMODULE_OK;
+    }
+
+    return bn_eval_helper(ctx, argv, argc);
+}
+
+/* BN.WAITUNTIL key <|<=|==|!=|>=|>|LT|LE|EQ|NE|GE|GT value timeout */
+int cmd_WAITUNTIL(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_wait_helper(ctx, argv, argc);
+}
+
+/* BN.SET key value [KEEPTTL] */
+int cmd_SET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int keepttl = 0;
+    uint32_t status = 0;
+    size_t len;
+    mstime_t ttl = REDISMODULE_NO_EXPIRE;
+    const char *val;
+    char *str;
+    mpd_t *dec;
+    bn_value_t *v;
+    RedisModuleKey *rk;
+
+    if (argc != 3 && argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (argc == 4) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[3], NULL), "keepttl")) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        keepttl = 1;
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    dec = decimal(val, len, 0);
+    if (dec == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    /* Like SET, overwrites whatever the key held before, and its TTL unless
+     * KEEPTTL is given. */
+    rk = RedisModule_OpenKey(ctx, argv[1],
+                             REDISMODULE_READ | REDISMODULE_WRITE);
+    v = keepttl ? bn_value_lookup(rk, 0) : NULL;
+    if (v == NULL) {
+        if (keepttl) {
+            ttl = RedisModule_GetExpire(rk);
+        }
+        v = bn_value_new();
+        RedisModule_ModuleTypeSetValue(rk, bn_type, v);
+        if (ttl != REDISMODULE_NO_EXPIRE) {
+            RedisModule_SetExpire(rk, ttl);
+        }
+    }
+    mpd_qcopy(&v->dec, dec, &status);
+    bn_value_compact(v);
+    bn_wait_signal(ctx, argv[1], &v->dec);
+
+    /* Replicated as rounded here, see bn_replicate_value(). */
+    len = bn_format(&v->dec, &str);
+    if (keepttl) {
+        RedisModule_Replicate(ctx, "BN.SET", "sbc", argv[1], str, len,
+                              "KEEPTTL");
+    } else {
+        RedisModule_Replicate(ctx, "BN.SET", "sb", argv[1], str, len);
+    }
+
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* BN.SETIFGT key value, sets key to value if it is missing or holds less */
+int cmd_SETIFGT(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_cset_helper(ctx, NULL, argv[1], argv + 2, 1, bn_cmp_gt);
+}
+
+/* BN.SETIFLT key value, sets key to value if it is missing or holds more */
+int cmd_SETIFLT(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_cset_helper(ctx, NULL, argv[1], argv + 2, 1, bn_cmp_lt);
+}
+
+/* BN.CAS key expected new, sets key to new if it holds a value equal to
+ * expected, e.g. 1.50 matches 1.5 */
+int cmd_CAS(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_cset_helper(ctx, NULL, argv[1], argv + 2, 2, bn_cmp_eq);
+}
+
+int cmd_INCR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_incr_helper(ctx, NULL, argv[1], mpd_one, 1, NULL, NULL);
+}
+
+int cmd_DECR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_incr_helper(ctx, NULL, argv[1], mpd_one, 0, NULL, NULL);
+}
+
+int cmd_INCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_incrby_helper(ctx, argv, argc, 1);
+}
+
+int cmd_DECRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_incrby_helper(ctx, argv, argc, 0);
+}
+
+/* BN.IDEM.RECORD key id expire reply [FIELD field]
+ *
+ * Records reply as the result of the increment of key, or of a field of
+ * the hash at key, made with IDEMPOTENCY id, until the unix time expire in
+ * milliseconds. This is how IDEMPOTENCY increments are replicated, next to
+ * the value they stored. */
+int cmd_IDEM_RECORD(RedisModuleCtx *ctx, RedisModuleString **argv,
+                    int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    long long expire, now;
+    size_t idlen, rlen;
+    const char *reply;
+    char *id;
+    RedisModuleString *field = NULL;
+
+    if (argc != 5 && argc != 7) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (argc == 7) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[5], NULL), "field")) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        field = argv[6];
+    }
+
+    if (RedisModule_StringToLongLong(argv[3], &expire) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR value is not an integer or out of range");
+    }
+
+    /* Already gone, e.g. when loading an old AOF. */
+    now = RedisModule_Milliseconds();
+    if (expire > now) {
+        id = bn_idem_id(ctx, argv[1], field, argv[2], &idlen);
+        reply = RedisModule_StringPtrLen(argv[4], &rlen);
+        bn_idem_expire(now);
+        bn_idem_put(id, idlen, expire, reply, rlen);
+    }
+
+    RedisModule_ReplicateVerbatim(ctx);
+
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int cmd_MINCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc < 3 || (argc - 1) % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_mincrby_helper(ctx, NULL, argv + 1, argc - 1);
+}
+
+/* BN.TRANSFER src dst amount [NONEGATIVE] */
+int cmd_TRANSFER(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 4 && argc != 5) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_transfer_helper(ctx, NULL, argv + 1, argc - 1);
+}
+
+/* BN.CINCRBY key delta, replies like BN.CGET. */
+int cmd_CINCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    size_t len;
+    const char *val;
+    mpd_t *delta, *res;
+    bn_counter_t *c;
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    delta = decimal(val, len, 0);
+    if (delta == NULL ||
+        bn_incr_check(ctx, NULL, argv[1]) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    /* A script is replicated as a whole and runs again on the replicas,
+     * where nothing may be left for a timer to write. */
+    if (RedisModule_GetContextFlags(ctx) &
+        (REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_REPLICATED)) {
+        if (bn_incr_apply(ctx, NULL, argv[1], delta, 1, NULL, &res) !=
+            REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+        bn_replicate_value(ctx, NULL, argv[1], res);
+    } else {
+        c = bn_counter_lookup(ctx, argv[1], 1);
+        bn_apply(c->delta, delta, op_add);
+        if (!bn_counters_armed) {
+            RedisModule_CreateTimer(ctx, bn_counter_flush_ms, bn_counter_flush,
+                                    NULL);
+            bn_counters_armed = 1;
+        }
+    }
+
+    return bn_reply_counter(ctx, argv[1], 0);
+}
+
+/* BN.CGET key [digits], the stored value plus the pending BN.CINCRBY
+ * deltas. */
+int cmd_CGET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    long long digits;
+
+    if (argc < 2 || argc > 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    digits = 0;
+    if (argc == 3) {
+        if (RedisModule_StringToLongLong(argv[2], &digits) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx,
+                                              "ERR invalid digits parameter");
+        }
+    }
+
+    return bn_reply_counter(ctx, argv[1], (int)digits);
+}
+
+int cmd_HGET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    long long digits;
+
+    if (argc < 3 || argc > 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    digits = 0;
+    if (argc == 4) {
+        if (RedisModule_StringToLongLong(argv[3], &digits) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx,
+                                              "ERR invalid digits parameter");
+        }
+    }
+
+    return bn_get_helper(ctx, argv[1], argv[2], (int)digits);
+}
+
+/* BN.HMGET hash digits field [field ...] */
+int cmd_HMGET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc < 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_mget_helper(ctx, argv[1], argv + 2, argc - 2);
+}
+
+int cmd_HINCR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_incr_helper(ctx, argv[1], argv[2], mpd_one, 1, NULL, NULL);
+}
+
+int cmd_HDECR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_incr_helper(ctx, argv[1], argv[2], mpd_one, 0, NULL, NULL);
+}
+
+int cmd_HMINCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc < 4 || (argc - 2) % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_mincrby_helper(ctx, argv[1], argv + 2, argc - 2);
+}
+
+/* BN.HTRANSFER hash src dst amount [NONEGATIVE] */
+int cmd_HTRANSFER(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 5 && argc != 6) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_transfer_helper(ctx, argv[1], argv + 2, argc - 2);
+}
+
+int cmd_HSUM(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_hagg_helper(ctx, argv, argc, bn_agg_sum);
+}
+
+int cmd_HMIN(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_hagg_helper(ctx, argv, argc, bn_agg_min);
+}
+
+int cmd_HMAX(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_hagg_helper(ctx, argv, argc, bn_agg_max);
+}
+
+/* BN.HSETIFGT hash field value */
+int cmd_HSETIFGT(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_cset_helper(ctx, argv[1], argv[2], argv + 3, 1, bn_cmp_gt);
+}
+
+/* BN.HSETIFLT hash field value */
+int cmd_HSETIFLT(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_cset_helper(ctx, argv[1], argv[2], argv + 3, 1, bn_cmp_lt);
+}
+
+/* BN.HCAS hash field expected new */
+int cmd_HCAS(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    if (argc != 5) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    return bn_cset_helper(ctx, argv[1], argv[2], argv + 3, 2, bn_cmp_eq);
+}
+
+int cmd_HINCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_hincrby_helper(ctx, argv, argc, 1);
+}
+
+int cmd_HDECRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_hincrby_helper(ctx, argv, argc, 0);
+}
+
+/* Sorted sets ordered by exact decimal scores, see BN.ZADD. Scores are kept
+ * as sort keys that compare with memcmp() in numeric order, so the skiplist
+ * never touches libmpdec:
+ *
+ *   class   1 byte, -inf < negative < zero < positive < +inf
+ *   adjexp  8 bytes big endian, the exponent of the leading digit, biased
+ *   digits  one nibble per digit, value + 1, trailing zeros stripped
+ *
+ * Negative keys have every byte after the class inverted and a 0xff
+ * terminator, so that larger magnitudes sort first and a prefix sorts last.
+ * Equal values have equal keys whatever their representation (1.5, 1.50,
+ * 15e-1), the node keeps the exponent to give back the exact decimal it was
+ * set to. Zero scores lose their sign, -0 is stored and given back as 0.
+ * Ties are broken by member, like ZSETs. The skiplist carries spans for
+ * O(log n) ranks, members are indexed by a dict. */
+#define BN_ZSET_TYPE_NAME "bn-sorted"
+#define BN_ZSET_ENCVER 0
+#define BN_ZSET_MAXLEVEL 32
+#define BN_ZSET_P 0.25
+
+#define BN_ZKEY_NEG_INF 0
+#define BN_ZKEY_NEG 1
+#define BN_ZKEY_ZERO 2
+#define BN_ZKEY_POS 3
+#define BN_ZKEY_POS_INF 4
+#define BN_ZKEY_SIZE(dec) ((size_t)(dec)->digits / 2 + 12)
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    mpd_ssize_t exp;
+} bn_zkey_t;
+
+typedef struct bn_znode_s {
+    unsigned char *key;
+    char *member;
+    uint32_t klen;
+    uint32_t mlen;
+    mpd_ssize_t exp;
+    int height;
+    struct bn_znode_s *backward;
+    struct {
+        struct bn_znode_s *forward;
+        unsigned long span;
+    } level[];
+} bn_znode_t;
+
+typedef struct {
+    bn_znode_t *header;
+    bn_znode_t *tail;
+    unsigned long length;
+    int level;
+    size_t bytes;
+    RedisModuleDict *members;
+} bn_zset_t;
+
+typedef struct {
+    bn_zkey_t min;
+    bn_zkey_t max;
+    int minex;
+    int maxex;
+} bn_zrange_t;
+
+/* Writes the sort key of a decimal that isn't NaN into buf, which must have
+ * room for BN_ZKEY_SIZE(dec) bytes, and returns its length. */
+static size_t bn_zkey_encode(const mpd_t *dec, unsigned char *buf) {
+    size_t i, n, len;
+    uint64_t adj;
+    char *digits;
+    unsigned char *p;
+
+    if (mpd_isinfinite(dec)) {
+        buf[0] = mpd_isnegative(dec) ? BN_ZKEY_NEG_INF : BN_ZKEY_POS_INF;
+        return 1;
+    }
+
+    if (mpd_iszero(dec)) {
+        buf[0] = BN_ZKEY_ZERO;
+        return 1;
+    }
+
+    digits = bn_scratch_buf((size_t)dec->digits);
+    n = bn_format_coeff(digits, dec);
+    while (digits[n - 1] == '0') {
+        n--;
+    }
+
+    adj = (uint64_t)(dec->exp + dec->digits - 1) ^ ((uint64_t)1 << 63);
+    for (i = 0; i < 8; i++) {
+        buf[1 + i] = (unsigned char)(adj >> (56 - 8 * i));
+    }
+
+    p = buf + 9;
+    for (i = 0; i < n; i += 2) {
+        *p = (unsigned char)((digits[i] - '0' + 1) << 4);
+        if (i + 1 < n) {
+            *p |= (unsigned char)(digits[i + 1] - '0' + 1);
+        }
+        p++;
+    }
+    len = (size_t)(p - buf);
+
+    if (mpd_isnegative(dec)) {
+        buf[0] = BN_ZKEY_NEG;
+        for (i = 1; i < len; i++) {
+            buf[i] = (unsigned char)~buf[i];
+        }
+        buf[len++] = 0xff;
+    } else {
+        buf[0] = BN_ZKEY_POS;
+    }
+
+    return len;
+}
+
+/* Rebuilds into dec the decimal with sort key key and exponent exp. */
+static void bn_zkey_decode(const unsigned char *key, size_t len,
+                           mpd_ssize_t exp, mpd_t *dec) {
+    int i, neg, shift = 4;
+    unsigned int d;
+    uint32_t status = 0;
+    uint64_t adj = 0;
+    mpd_uint_t word = 0;
+    mpd_ssize_t adjexp, digits, k, words;
+    const unsigned char *p, *end;
+
+    switch (key[0]) {
+    case BN_ZKEY_NEG_INF:
+    case BN_ZKEY_POS_INF:
+        mpd_setspecial(dec, key[0] == BN_ZKEY_NEG_INF ? MPD_NEG : MPD_POS,
+                       MPD_INF);
+        return;
+    case BN_ZKEY_ZERO:
+        mpd_zerocoeff(dec);
+        mpd_clear_flags(dec);
+        dec->exp = exp;
+        return;
+    }
+
+    neg = key[0] == BN_ZKEY_NEG;
+    end = key + len - neg;
+
+    for (i = 1; i < 9; i++) {
+        adj = adj << 8 | (unsigned char)(neg ? ~key[i] : key[i]);
+    }
+    adjexp = (mpd_ssize_t)(int64_t)(adj ^ ((uint64_t)1 << 63));
+
+    digits = adjexp - exp + 1;
+    words = (digits + MPD_RDIGITS - 1) / MPD_RDIGITS;
+    mpd_qresize(dec, words, &status);
+
+    /* Digits run out at the first zero nibble or the end of the key, the
+     * rest of the coefficient are the zeros that were stripped. */
+    for (p = key + 9, k = digits - 1; k >= 0; k--) {
+        d = 0;
+        if (p < end) {
+            d = ((unsigned char)(neg ? ~*p : *p) >> shift) & 0xf;
+            shift ^= 4;
+            p += shift != 0;
+            if (d == 0) {
+                p = end;
+            } else {
+                d--;
+            }
+        }
+        word = word * 10 + d;
+        if (k % MPD_RDIGITS == 0) {
+            dec->data[k / MPD_RDIGITS] = word;
+            word = 0;
+        }
+    }
+
+    mpd_clear_flags(dec);
+    if (neg) {
+        mpd_set_negative(dec);
+    }
+    dec->exp = exp;
+    dec->len = words;
+    mpd_setdigits(dec);
+}
+
+static inline int bn_zkey_cmp(const unsigned char *a, size_t alen,
+                              const unsigned char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+
+    return c ? c : (alen > blen) - (alen < blen);
+}
+
+/* Parses a score into its sort key, allocated from the command's pool. NaN
+ * is rejected like any malformed number. */
+static int bn_zkey_parse(RedisModuleCtx *ctx, const char *val, size_t len,
+                         bn_zkey_t *key) {
+    mpd_t *dec = decimal(val, len, 0);
+
+    if (dec == NULL || mpd_isnan(dec)) {
+        return REDISMODULE_ERR;
+    }
+
+    key->buf = RedisModule_PoolAlloc(ctx, BN_ZKEY_SIZE(dec));
+    key->len = bn_zkey_encode(dec, key->buf);
+    key->exp = dec->exp;
+
+    return REDISMODULE_OK;
+}
+
+static inline int bn_znode_cmp(const bn_znode_t *x, const unsigned char *key,
+                               size_t klen, const char *member, size_t mlen) {
+    int c = bn_zkey_cmp(x->key, x->klen, key, klen);
+
+    return c ? c
+             : bn_zkey_cmp((const unsigned char *)x->member, x->mlen,
+                           (const unsigned char *)member, mlen);
+}
+
+/* One allocation per node: the levels, then the key and member bytes. */
+static inline size_t bn_znode_size(int height, size_t klen, size_t mlen) {
+    return sizeof(bn_znode_t) +
+           (size_t)height * sizeof(((bn_znode_t *)0)->level[0]) + klen + mlen;
+}
+
+static bn_znode_t *bn_znode_new(int height, const unsigned char *key,
+                                size_t klen, const char *member, size_t mlen) {
+    bn_znode_t *x = RedisModule_Calloc(1, bn_znode_size(height, klen, mlen));
+
+    x->key = (unsigned char *)&x->level[height];
+    x->member = (char *)x->key + klen;
+    x->klen = (uint32_t)klen;
+    x->mlen = (uint32_t)mlen;
+    x->height = height;
+    if (klen > 0) {
+        memcpy(x->key, key, klen);
+    }
+    if (mlen > 0) {
+        memcpy(x->member, member, mlen);
+    }
+
+    return x;
+}
+
+static bn_zset_t *bn_zset_new(void) {
+    bn_zset_t *zs = RedisModule_Calloc(1, sizeof(*zs));
+
+    zs->header = bn_znode_new(BN_ZSET_MAXLEVEL, NULL, 0, NULL, 0);
+    zs->level = 1;
+    zs->bytes = sizeof(*zs) + bn_znode_size(BN_ZSET_MAXLEVEL, 0, 0);
+    zs->members = RedisModule_CreateDict(NULL);
+
+    return zs;
+}
+
+static void bn_zset_free(void *value) {
+    bn_zset_t *zs = value;
+    bn_znode_t *x, *next;
+
+    for (x = zs->header; x != NULL; x = next) {
+        next = x->level[0].forward;
+        RedisModule_Free(x);
+    }
+    RedisModule_FreeDict(NULL, zs->members);
+    RedisModule_Free(zs);
+}
+
+static int bn_zset_random_level(void) {
+    int level = 1;
+
+    while (level < BN_ZSET_MAXLEVEL &&
+           (random() & 0xffff) < (long)(BN_ZSET_P * 0xffff)) {
+        level++;
+    }
+
+    return level;
+}
+
+static bn_znode_t *bn_zset_insert(bn_zset_t *zs, const bn_zkey_t *key,
+                                  const char *member, size_t mlen) {
+    int i, height;
+    unsigned long rank[BN_ZSET_MAXLEVEL];
+    bn_znode_t *update[BN_ZSET_MAXLEVEL], *x = zs->header;
+
+    for (i = zs->level - 1; i >= 0; i--) {
+        rank[i] = i == zs->level - 1 ? 0 : rank[i + 1];
+        while (x->level[i].forward != NULL &&
+               bn_znode_cmp(x->level[i].forward, key->buf, key->len, member,
+                            mlen) < 0) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+
+    height = bn_zset_random_level();
+    if (height > zs->level) {
+        for (i = zs->level; i < height; i++) {
+            rank[i] = 0;
+            update[i] = zs->header;
+            update[i]->level[i].span = zs->length;
+        }
+        zs->level = height;
+    }
+
+    x = bn_znode_new(height, key->buf, key->len, member, mlen);
+    x->exp = key->exp;
+    for (i = 0; i < height; i++) {
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
+        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    }
+    for (i = height; i < zs->level; i++) {
+        update[i]->level[i].span++;
+    }
+
+    x->backward = update[0] == zs->header ? NULL : update[0];
+    if (x->level[0].forward != NULL) {
+        x->level[0].forward->backward = x;
+    } else {
+        zs->tail = x;
+    }
+
+    zs->length++;
+    zs->bytes += bn_znode_size(height, key->len, mlen);
+
+    return x;
+}
+
+/* Unlinks and frees a node, its member stays in the dict. */
+static void bn_zset_delete(bn_zset_t *zs, bn_znode_t *node) {
+    int i;
+    bn_znode_t *update[BN_ZSET_MAXLEVEL], *x = zs->header;
+
+    for (i = zs->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL &&
+               bn_znode_cmp(x->level[i].forward, node->key, node->klen,
+                            node->member, node->mlen) < 0) {
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+
+    for (i = 0; i < zs->level; i++) {
+        if (update[i]->level[i].forward == node) {
+            update[i]->level[i].span += node->level[i].span - 1;
+            update[i]->level[i].forward = node->level[i].forward;
+        } else {
+            update[i]->level[i].span--;
+        }
+    }
+
+    if (node->level[0].forward != NULL) {
+        node->level[0].forward->backward = node->backward;
+    } else {
+        zs->tail = node->backward;
+    }
+
+    while (zs->level > 1 && zs->header->level[zs->level - 1].forward == NULL) {
+        zs->level--;
+    }
+
+    zs->length--;
+    zs->bytes -= bn_znode_size(node->height, node->klen, node->mlen);
+    RedisModule_Free(node);
+}
+
+/* Sets the score of a member, returns whether it's a new one. */
+static int bn_zset_set(bn_zset_t *zs, const bn_zkey_t *key,
+                       const char *member, size_t mlen) {
+    bn_znode_t *node;
+
+    node = RedisModule_DictGetC(zs->members, (void *)member, mlen, NULL);
+    if (node != NULL) {
+        if (node->exp == key->exp &&
+            !bn_zkey_cmp(node->key, node->klen, key->buf, key->len)) {
+            return 0;
+        }
+        bn_zset_delete(zs, node);
+    }
+
+    RedisModule_DictReplaceC(zs->members, (void *)member, mlen,
+                             bn_zset_insert(zs, key, member, mlen));
+
+    return node == NULL;
+}
+
+/* 1-based rank of a node. */
+static unsigned long bn_zset_rank(const bn_zset_t *zs, const bn_znode_t *node) {
+    int i;
+    unsigned long rank = 0;
+    bn_znode_t *x = zs->header;
+
+    for (i = zs->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL &&
+               bn_znode_cmp(x->level[i].forward, node->key, node->klen,
+                            node->member, node->mlen) <= 0) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (x == node) {
+            return rank;
+        }
+    }
+
+    return 0;
+}
+
+/* Node at a 1-based rank. */
+static bn_znode_t *bn_zset_at(const bn_zset_t *zs, unsigned long rank) {
+    int i;
+    unsigned long traversed = 0;
+    bn_znode_t *x = zs->header;
+
+    if (rank == 0 || rank > zs->length) {
+        return NULL;
+    }
+
+    for (i = zs->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL &&
+               traversed + x->level[i].span <= rank) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (traversed == rank) {
+            return x;
+        }
+    }
+
+    return NULL;
+}
+
+static inline int bn_zrange_above_min(const bn_zrange_t *r,
+                                      const bn_znode_t *x) {
+    int c = bn_zkey_cmp(x->key, x->klen, r->min.buf, r->min.len);
+
+    return r->minex ? c > 0 : c >= 0;
+}
+
+static inline int bn_zrange_below_max(const bn_zrange_t *r,
+                                      const bn_znode_t *x) {
+    int c = bn_zkey_cmp(x->key, x->klen, r->max.buf, r->max.len);
+
+    return r->maxex ? c < 0 : c <= 0;
+}
+
+/* First and last nodes in the range, NULL if it's empty. */
+static bn_znode_t *bn_zset_first_in(const bn_zset_t *zs, const bn_zrange_t *r) {
+    int i;
+    bn_znode_t *x = zs->header;
+
+    for (i = zs->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL &&
+               !bn_zrange_above_min(r, x->level[i].forward)) {
+            x = x->level[i].forward;
+        }
+    }
+
+    x = x->level[0].forward;
+
+    return x != NULL && bn_zrange_below_max(r, x) ? x : NULL;
+}
+
+static bn_znode_t *bn_zset_last_in(const bn_zset_t *zs, const bn_zrange_t *r) {
+    int i;
+    bn_znode_t *x = zs->header;
+
+    for (i = zs->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL &&
+               bn_zrange_below_max(r, x->level[i].forward)) {
+            x = x->level[i].forward;
+        }
+    }
+
+    return x != zs->header && bn_zrange_above_min(r, x) ? x : NULL;
+}
+
+/* Points *zs at the sorted set behind an open key, creating an empty one if
+ * create is set. *zs is NULL if the key is empty. Returns REDISMODULE_ERR if
+ * the key holds anything else. */
+static int bn_zset_lookup(RedisModuleKey *rk, int create, bn_zset_t **zs) {
+    *zs = NULL;
+
+    if (RedisModule_KeyType(rk) == REDISMODULE_KEYTYPE_EMPTY) {
+        if (create) {
+            *zs = bn_zset_new();
+            RedisModule_ModuleTypeSetValue(rk, bn_zset_type, *zs);
+        }
+        return REDISMODULE_OK;
+    }
+
+    if (RedisModule_ModuleTypeGetType(rk) != bn_zset_type) {
+        return REDISMODULE_ERR;
+    }
+
+    *zs = RedisModule_ModuleTypeGetValue(rk);
+
+    return REDISMODULE_OK;
+}
+
+static inline int bn_reply_zscore(RedisModuleCtx *ctx, const bn_znode_t *x) {
+    int rc;
+    size_t mark = bn_scratch_mark();
+    mpd_t *dec = bn_scratch_new();
+
+    bn_zkey_decode(x->key, x->klen, x->exp, dec);
+    rc = bn_reply_decimal(ctx, dec);
+    bn_scratch_release(mark);
+
+    return rc;
+}
+
+/* A range bound is a decimal, -inf or +inf, exclusive with a ( prefix. */
+static int bn_zrange_bound(RedisModuleCtx *ctx, RedisModuleString *str,
+                           bn_zkey_t *key, int *ex) {
+    size_t len;
+    const char *val = RedisModule_StringPtrLen(str, &len);
+
+    *ex = len > 0 && val[0] == '(';
+
+    return bn_zkey_parse(ctx, val + *ex, len - (size_t)*ex, key);
+}
+
+static inline int bn_zrank_helper(RedisModuleCtx *ctx,
+                                  RedisModuleString **argv, int argc,
+                                  int rev) {
+    size_t len;
+    const char *member;
+    unsigned long rank;
+    bn_zset_t *zs;
+    bn_znode_t *node = NULL;
+    RedisModuleKey *rk;
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_zset_lookup(rk, 0, &zs) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    member = RedisModule_StringPtrLen(argv[2], &len);
+    if (zs != NULL) {
+        node = RedisModule_DictGetC(zs->members, (void *)member, len, NULL);
+    }
+    if (node == NULL) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    rank = bn_zset_rank(zs, node);
+
+    return RedisModule_ReplyWithLongLong(
+        ctx, (long long)(rev ? zs->length - rank : rank - 1));
+}
+
+/* Replies with the members in [min, max] in score order, or the reverse
+ * when rev is set, optionally with their scores. LIMIT skips to the offset
+ * by rank rather than walking the list. */
+static inline int bn_zrange_helper(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv, int argc,
+                                   int rev) {
+    int i, withscores = 0;
+    long long offset = 0, count = -1;
+    long n = 0;
+    unsigned long rank;
+    const char *opt;
+    bn_zrange_t r;
+    bn_zset_t *zs;
+    bn_znode_t *x = NULL;
+    RedisModuleKey *rk;
+
+    if (argc < 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    for (i = 4; i < argc; i++) {
+        opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(opt, "withscores")) {
+            withscores = 1;
+        } else if (!strcasecmp(opt, "limit") && i + 2 < argc) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &offset) !=
+                    REDISMODULE_OK ||
+                RedisModule_StringToLongLong(argv[i + 2], &count) !=
+                    REDISMODULE_OK) {
+                return RedisModule_ReplyWithError(
+                    ctx, "ERR value is not an integer or out of range");
+            }
+            i += 2;
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+    }
+
+    if (bn_zrange_bound(ctx, argv[rev ? 3 : 2], &r.min, &r.minex) !=
+            REDISMODULE_OK ||
+        bn_zrange_bound(ctx, argv[rev ? 2 : 3], &r.max, &r.maxex) !=
+            REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx,
+                                          "ERR min or max is not a decimal");
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_zset_lookup(rk, 0, &zs) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (zs != NULL && offset >= 0) {
+        x = rev ? bn_zset_last_in(zs, &r) : bn_zset_first_in(zs, &r);
+    }
+    if (x != NULL && offset > 0) {
+        rank = bn_zset_rank(zs, x);
+        if (rev) {
+            x = (unsigned long long)offset < rank
+                    ? bn_zset_at(zs, rank - (unsigned long)offset)
+                    : NULL;
+        } else {
+            x = (unsigned long long)offset <= zs->length - rank
+                    ? bn_zset_at(zs, rank + (unsigned long)offset)
+                    : NULL;
+        }
+    }
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+
+    while (x != NULL && count != 0 &&
+           (rev ? bn_zrange_above_min(&r, x) : bn_zrange_below_max(&r, x))) {
+        RedisModule_ReplyWithStringBuffer(ctx, x->member, x->mlen);
+        if (withscores) {
+            bn_reply_zscore(ctx, x);
+        }
+        n++;
+        count--;
+        x = rev ? x->backward : x->level[0].forward;
+    }
+
+    RedisModule_ReplySetArrayLength(ctx, withscores ? 2 * n : n);
+
+    return REDISMODULE_OK;
+}
+
+/* BN.ZADD key score member [score member ...] */
+int cmd_ZADD(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i, n;
+    long long added = 0;
+    size_t len;
+    const char *val;
+    mpd_t *dec;
+    bn_zkey_t *keys;
+    bn_zset_t *zs;
+    RedisModuleKey *rk;
+    RedisModuleString **args;
+
+    if (argc < 4 || (argc - 2) % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    /* All or nothing, every score is parsed before the first write. */
+    n = (argc - 2) / 2;
+    keys = RedisModule_PoolAlloc(ctx, (size_t)n * sizeof(*keys));
+    for (i = 0; i < n; i++) {
+        val = RedisModule_StringPtrLen(argv[2 + 2 * i], &len);
+        if (bn_zkey_parse(ctx, val, len, &keys[i]) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+        bn_scratch_reset();
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1],
+                             REDISMODULE_READ | REDISMODULE_WRITE);
+    if (bn_zset_lookup(rk, 1, &zs) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    /* Replicated with the scores as parsed here. */
+    args = RedisModule_PoolAlloc(ctx, (size_t)(argc - 2) * sizeof(*args));
+    for (i = 0; i < n; i++) {
+        val = RedisModule_StringPtrLen(argv[3 + 2 * i], &len);
+        added += bn_zset_set(zs, &keys[i], val, len);
+        dec = bn_scratch_new();
+        bn_zkey_decode(keys[i].buf, keys[i].len, keys[i].exp, dec);
+        args[2 * i] = bn_decimal_string(ctx, dec);
+        args[2 * i + 1] = argv[3 + 2 * i];
+        bn_scratch_reset();
+    }
+
+    RedisModule_Replicate(ctx, "BN.ZADD", "sv", argv[1], args,
+                          (size_t)(argc - 2));
+
+    return RedisModule_ReplyWithLongLong(ctx, added);
+}
+
+/* BN.ZINCRBY key delta member */
+int cmd_ZINCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    size_t len;
+    const char *val;
+    mpd_t *delta, *score;
+    bn_zkey_t key;
+    bn_zset_t *zs;
+    bn_znode_t *node = NULL;
+    RedisModuleKey *rk;
+
+    if (argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    delta = decimal(val, len, 0);
+    if (delta == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1],
+                             REDISMODULE_READ | REDISMODULE_WRITE);
+    if (bn_zset_lookup(rk, 0, &zs) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    val = RedisModule_StringPtrLen(argv[3], &len);
+    score = bn_scratch_new();
+    if (zs != NULL) {
+        node = RedisModule_DictGetC(zs->members, (void *)val, len, NULL);
+    }
+    if (node != NULL) {
+        bn_zkey_decode(node->key, node->klen, node->exp, score);
+    }
+
+    bn_apply(score, delta, op_add);
+    if (mpd_isnan(score)) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR resulting score is not a number (NaN)");
+    }
+
+    if (mpd_iszero(score)) {
+        mpd_set_positive(score);
+    }
+
+    key.buf = RedisModule_PoolAlloc(ctx, BN_ZKEY_SIZE(score));
+    key.len = bn_zkey_encode(score, key.buf);
+    key.exp = score->exp;
+
+    if (zs == NULL) {
+        bn_zset_lookup(rk, 1, &zs);
+    }
+    bn_zset_set(zs, &key, val, len);
+
+    RedisModule_Replicate(ctx, "BN.ZADD", "sss", argv[1],
+                          bn_decimal_string(ctx, score), argv[3]);
+
+    return bn_reply_decimal(ctx, score);
+}
+
+/* BN.ZREM key member [member ...] */
+int cmd_ZREM(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i;
+    long long removed = 0;
+    size_t len;
+    const char *val;
+    bn_zset_t *zs;
+    bn_znode_t *node;
+    RedisModuleKey *rk;
+
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1],
+                             REDISMODULE_READ | REDISMODULE_WRITE);
+    if (bn_zset_lookup(rk, 0, &zs) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (zs == NULL) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    for (i = 2; i < argc; i++) {
+        val = RedisModule_StringPtrLen(argv[i], &len);
+        if (RedisModule_DictDelC(zs->members, (void *)val, len, &node) ==
+            REDISMODULE_OK) {
+            bn_zset_delete(zs, node);
+            removed++;
+        }
+    }
+
+    if (zs->length == 0) {
+        RedisModule_DeleteKey(rk);
+    }
+
+    if (removed > 0) {
+        RedisModule_ReplicateVerbatim(ctx);
+    }
+
+    return RedisModule_ReplyWithLongLong(ctx, removed);
+}
+
+/* BN.ZSCORE key member */
+int cmd_ZSCORE(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    size_t len;
+    const char *val;
+    bn_zset_t *zs;
+    bn_znode_t *node = NULL;
+    RedisModuleKey *rk;
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_zset_lookup(rk, 0, &zs) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    if (zs != NULL) {
+        node = RedisModule_DictGetC(zs->members, (void *)val, len, NULL);
+    }
+
+    if (node == NULL) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    return bn_reply_zscore(ctx, node);
+}
+
+/* BN.ZCARD key */
+int cmd_ZCARD(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    bn_zset_t *zs;
+    RedisModuleKey *rk;
+
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_zset_lookup(rk, 0, &zs) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    return RedisModule_ReplyWithLongLong(
+        ctx, zs != NULL ? (long long)zs->length : 0);
+}
+
+/* BN.ZRANK key member, 0 is the lowest score. */
+int cmd_ZRANK(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_zrank_helper(ctx, argv, argc, 0);
+}
+
+/* BN.ZREVRANK key member, 0 is the highest score. */
+int cmd_ZREVRANK(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_zrank_helper(ctx, argv, argc, 1);
+}
+
+/* BN.ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count] */
+int cmd_ZRANGEBYSCORE(RedisModuleCtx *ctx, RedisModuleString **argv,
+                      int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_zrange_helper(ctx, argv, argc, 0);
+}
+
+/* BN.ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count] */
+int cmd_ZREVRANGEBYSCORE(RedisModuleCtx *ctx, RedisModuleString **argv,
+                         int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+    return bn_zrange_helper(ctx, argv, argc, 1);
+}
+
+/* "bn-ledger" keys are append-only lists of (timestamp, id, delta) entries
+ * that keep their running balance. Entries are packed back to back as a
+ * bn_lrec_t header followed by the coefficient words of the delta, in chunks
+ * of BN_LEDGER_CHUNK. Each chunk checkpoints the balance before its first
+ * entry and the timestamps it spans, so the balance at a point in time is a
+ * binary search over the chunks plus at most one chunk of additions, and a
+ * range starts with the same search. Timestamps are in milliseconds and never
+ * go backwards, like stream IDs. The balance at a time is replayed with the
+ * same rounding as the running one, both agree unless the context changed in
+ * between. */
+#define BN_LEDGER_TYPE_NAME "bn-ledger"
+#define BN_LEDGER_ENCVER 0
+#define BN_LEDGER_CHUNK 128
+#define BN_LREC_SIZE(len)                                                      \
+    (sizeof(bn_lrec_t) + (size_t)(len) * sizeof(mpd_uint_t))
+
+/* 32 bytes, so the coefficient words that follow stay aligned. */
+typedef struct {
+    int64_t ts;
+    int64_t id;
+    int64_t exp;
+    uint32_t len;
+    uint32_t sign;
+} bn_lrec_t;
+
+typedef struct {
+    int64_t first;
+    int64_t last;
+    uint32_t n;
+    size_t used;
+    size_t size;
+    mpd_t *base;
+    unsigned char *buf;
+} bn_lchunk_t;
+
+typedef struct {
+    bn_lchunk_t *chunks;
+    size_t nchunks;
+    size_t cap;
+    uint64_t length;
+    size_t bytes;
+    mpd_t *balance;
+} bn_ledger_t;
+
+/* Points dec at the delta of a record without copying it. */
+static inline void bn_lrec_view(const bn_lrec_t *r, mpd_t *dec) {
+    dec->flags = MPD_STATIC | MPD_CONST_DATA | (uint8_t)r->sign;
+    dec->exp = (mpd_ssize_t)r->exp;
+    dec->len = dec->alloc = (mpd_ssize_t)r->len;
+    dec->data = (mpd_uint_t *)(r + 1);
+    mpd_setdigits(dec);
+}
+
+static inline const bn_lrec_t *bn_lrec_next(const bn_lrec_t *r) {
+    return (const bn_lrec_t *)((const unsigned char *)r +
+                               BN_LREC_SIZE(r->len));
+}
+
+static bn_ledger_t *bn_ledger_new(void) {
+    bn_ledger_t *lg = RedisModule_Calloc(1, sizeof(*lg));
+
+    lg->balance = mpd_qnew();
+    mpd_zerocoeff(lg->balance);
+    lg->bytes = sizeof(*lg);
+
+    return lg;
+}
+
+static void bn_ledger_free(void *value) {
+    size_t i;
+    bn_ledger_t *lg = value;
+
+    for (i = 0; i < lg->nchunks; i++) {
+        mpd_del(lg->chunks[i].base);
+        RedisModule_Free(lg->chunks[i].buf);
+    }
+    RedisModule_Free(lg->chunks);
+    mpd_del(lg->balance);
+    RedisModule_Free(lg);
+}
+
+/* Appends an entry, ts must not be older than the last one and delta must be
+ * finite. */
+static void bn_ledger_append(bn_ledger_t *lg, int64_t ts, int64_t id,
+                             const mpd_t *delta) {
+    uint32_t status = 0;
+    size_t size = BN_LREC_SIZE(delta->len);
+    bn_lchunk_t *c = lg->nchunks > 0 ? &lg->chunks[lg->nchunks - 1] : NULL;
+    bn_lrec_t *r;
+
+    if (c == NULL || c->n == BN_LEDGER_CHUNK) {
+        if (lg->nchunks == lg->cap) {
+            lg->bytes -= lg->cap * sizeof(*c);
+            lg->cap = lg->cap == 0 ? 4 : lg->cap * 2;
+            lg->bytes += lg->cap * sizeof(*c);
+            lg->chunks =
+                RedisModule_Realloc(lg->chunks, lg->cap * sizeof(*c));
+        }
+        c = &lg->chunks[lg->nchunks++];
+        memset(c, 0, sizeof(*c));
+        c->first = ts;
+        c->base = mpd_qnew();
+        mpd_qcopy(c->base, lg->balance, &status);
+        lg->bytes += sizeof(*c->base) +
+                     (size_t)c->base->alloc * sizeof(mpd_uint_t);
+    }
+
+    if (c->used + size > c->size) {
+        lg->bytes -= c->size;
+        c->size = c->size == 0 ? 512 : c->size * 2;
+        while (c->used + size > c->size) {
+            c->size *= 2;
+        }
+        c->buf = RedisModule_Realloc(c->buf, c->size);
+        lg->bytes += c->size;
+    }
+
+    r = (bn_lrec_t *)(c->buf + c->used);
+    r->ts = ts;
+    r->id = id;
+    r->exp = delta->exp;
+    r->len = (uint32_t)delta->len;
+    r->sign = mpd_sign(delta);
+    memcpy(r + 1, delta->data, (size_t)delta->len * sizeof(mpd_uint_t));
+
+    c->used += size;
+    c->last = ts;
+    c->n++;
+    lg->length++;
+    bn_apply(lg->balance, delta, op_add);
+}
+
+static inline int64_t bn_ledger_last_ts(const bn_ledger_t *lg) {
+    return lg->nchunks > 0 ? lg->chunks[lg->nchunks - 1].last : INT64_MIN;
+}
+
+/* The number of chunks whose first entry is at or before ts. */
+static size_t bn_ledger_chunks_upto(const bn_ledger_t *lg, int64_t ts) {
+    size_t mid, lo = 0, hi = lg->nchunks;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (lg->chunks[mid].first <= ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* The number of chunks whose last entry is before ts. */
+static size_t bn_ledger_chunks_before(const bn_ledger_t *lg, int64_t ts) {
+    size_t mid, lo = 0, hi = lg->nchunks;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (lg->chunks[mid].last < ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* res = the balance after every entry at or before ts. O(1) when ts is at or
+ * past the end of a chunk, otherwise replays part of one chunk. */
+static void bn_ledger_balance_at(const bn_ledger_t *lg, int64_t ts,
+                                 mpd_t *res) {
+    uint32_t i, status = 0;
+    mpd_t view;
+    const bn_lchunk_t *c;
+    const bn_lrec_t *r;
+    size_t k = bn_ledger_chunks_upto(lg, ts);
+
+    if (k == 0) {
+        mpd_qcopy(res, mpd_zero, &status);
+        return;
+    }
+
+    c = &lg->chunks[k - 1];
+    if (c->last <= ts) {
+        mpd_qcopy(res, k < lg->nchunks ? lg->chunks[k].base : lg->balance,
+                  &status);
+        return;
+    }
+
+    mpd_qcopy(res, c->base, &status);
+    r = (const bn_lrec_t *)c->buf;
+    for (i = 0; i < c->n && r->ts <= ts; i++, r = bn_lrec_next(r)) {
+        bn_lrec_view(r, &view);
+        bn_apply(res, &view, op_add);
+    }
+}
+
+/* Points *lg at the ledger behind an open key, creating an empty one if create
+ * is set. *lg is NULL if the key is empty. Returns REDISMODULE_ERR if the key
+ * holds anything else. */
+static int bn_ledger_lookup(RedisModuleKey *rk, int create, bn_ledger_t **lg) {
+    *lg = NULL;
+
+    if (RedisModule_KeyType(rk) == REDISMODULE_KEYTYPE_EMPTY) {
+        if (create) {
+            *lg = bn_ledger_new();
+            RedisModule_ModuleTypeSetValue(rk, bn_ledger_type, *lg);
+        }
+        return REDISMODULE_OK;
+    }
+
+    if (RedisModule_ModuleTypeGetType(rk) != bn_ledger_type) {
+        return REDISMODULE_ERR;
+    }
+
+    *lg = RedisModule_ModuleTypeGetValue(rk);
+
+    return REDISMODULE_OK;
+}
+
+/* A range bound is a timestamp, - for the first entry or + for the last. */
+static int bn_time_bound(RedisModuleString *str, int64_t *ts) {
+    long long ll;
+    const char *val = RedisModule_StringPtrLen(str, NULL);
+
+    if (!strcmp(val, "-")) {
+        *ts = INT64_MIN;
+    } else if (!strcmp(val, "+")) {
+        *ts = INT64_MAX;
+    } else if (RedisModule_StringToLongLong(str, &ll) == REDISMODULE_OK) {
+        *ts = ll;
+    } else {
+        return REDISMODULE_ERR;
+    }
+
+    return REDISMODULE_OK;
+}
+
+/* BN.LEDGER.APPEND key delta [TS ts] [ID id]
+ *
+ * ts defaults to the server time, or the last timestamp if the clock went
+ * back, and id to the position of the entry, starting at 1. Replies with the
+ * new balance. Always replicated with both, so replicas store the same entry.
+ */
+int cmd_LEDGER_APPEND(RedisModuleCtx *ctx, RedisModuleString **argv,
+                      int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i, has_ts = 0, has_id = 0;
+    long long ts = 0, id = 0;
+    size_t len;
+    const char *val;
+    mpd_t *delta;
+    bn_ledger_t *lg;
+    RedisModuleKey *rk;
+
+    if (argc < 3 || argc % 2 == 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    for (i = 3; i < argc; i += 2) {
+        val = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(val, "ts")) {
+            has_ts = 1;
+            if (RedisModule_StringToLongLong(argv[i + 1], &ts) !=
+                REDISMODULE_OK) {
+                return RedisModule_ReplyWithError(
+                    ctx, "ERR value is not an integer or out of range");
+            }
+        } else if (!strcasecmp(val, "id")) {
+            has_id = 1;
+            if (RedisModule_StringToLongLong(argv[i + 1], &id) !=
+                REDISMODULE_OK) {
+                return RedisModule_ReplyWithError(
+                    ctx, "ERR value is not an integer or out of range");
+            }
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    delta = decimal(val, len, 0);
+    if (delta == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+    if (mpd_isspecial(delta)) {
+        return RedisModule_ReplyWithError(ctx,
+                                          "ERR delta must be a finite decimal");
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1],
+                             REDISMODULE_READ | REDISMODULE_WRITE);
+    if (bn_ledger_lookup(rk, 0, &lg) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (!has_ts) {
+        ts = RedisModule_Milliseconds();
+        if (lg != NULL && ts < bn_ledger_last_ts(lg)) {
+            ts = bn_ledger_last_ts(lg);
+        }
+    } else if (lg != NULL && ts < bn_ledger_last_ts(lg)) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR timestamp is older than the last entry");
+    }
+
+    if (lg == NULL) {
+        bn_ledger_lookup(rk, 1, &lg);
+    }
+    if (!has_id) {
+        id = (long long)lg->length + 1;
+    }
+
+    bn_ledger_append(lg, ts, id, delta);
+
+    RedisModule_Replicate(ctx, "bn.ledger.append", "ssclcl", argv[1], argv[2],
+                          "TS", ts, "ID", id);
+
+    return bn_reply_decimal(ctx, lg->balance);
+}
+
+/* BN.LEDGER.BALANCE key [AT ts]
+ *
+ * The current balance, or the one after every entry at or before ts. */
+int cmd_LEDGER_BALANCE(RedisModuleCtx *ctx, RedisModuleString **argv,
+                       int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    long long ts;
+    mpd_t *res;
+    bn_ledger_t *lg;
+    RedisModuleKey *rk;
+
+    if (argc != 2 && argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (argc == 4) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "at")) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        if (RedisModule_StringToLongLong(argv[3], &ts) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(
+                ctx, "ERR value is not an integer or out of range");
+        }
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_ledger_lookup(rk, 0, &lg) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+    if (lg == NULL) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+    if (argc == 2) {
+        return bn_reply_decimal(ctx, lg->balance);
+    }
+
+    res = bn_scratch_new();
+    bn_ledger_balance_at(lg, ts, res);
+
+    return bn_reply_decimal(ctx, res);
+}
+
+/* BN.LEDGER.RANGE key start end [COUNT count]
+ *
+ * Replies with the entries with start <= timestamp <= end, oldest first, each
+ * as a [timestamp, id, delta] array. */
+int cmd_LEDGER_RANGE(RedisModuleCtx *ctx, RedisModuleString **argv,
+                     int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    uint32_t i;
+    long long count = -1;
+    long n = 0;
+    size_t k;
+    int64_t start, end;
+    mpd_t view;
+    const bn_lchunk_t *c;
+    const bn_lrec_t *r;
+    bn_ledger_t *lg;
+    RedisModuleKey *rk;
+
+    if (argc != 4 && argc != 6) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (bn_time_bound(argv[2], &start) != REDISMODULE_OK ||
+        bn_time_bound(argv[3], &end) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR start or end is not a timestamp");
+    }
+    if (argc == 6) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[4], NULL), "count")) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        if (RedisModule_StringToLongLong(argv[5], &count) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(
+                ctx, "ERR value is not an integer or out of range");
+        }
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_ledger_lookup(rk, 0, &lg) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+    if (lg == NULL || start > end || count == 0) {
+        return RedisModule_ReplyWithArray(ctx, 0);
+    }
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+
+    for (k = bn_ledger_chunks_before(lg, start);
+         k < lg->nchunks && count != 0; k++) {
+        c = &lg->chunks[k];
+        if (c->first > end) {
+            break;
+        }
+        r = (const bn_lrec_t *)c->buf;
+        for (i = 0; i < c->n && count != 0; i++, r = bn_lrec_next(r)) {
+            if (r->ts < start) {
+                continue;
+            }
+            if (r->ts > end) {
+                break;
+            }
+            bn_lrec_view(r, &view);
+            RedisModule_ReplyWithArray(ctx, 3);
+            RedisModule_ReplyWithLongLong(ctx, r->ts);
+            RedisModule_ReplyWithLongLong(ctx, r->id);
+            bn_reply_decimal(ctx, &view);
+            n++;
+            count--;
+        }
+    }
+
+    RedisModule_ReplySetArrayLength(ctx, n);
+
+    return REDISMODULE_OK;
+}
+
+/* "bn-series" keys aggregate values into fixed-width time buckets, keeping
+ * the exact sum, min, max and count of each. The buckets live in a ring of
+ * nslots fixed-size slots, bucket b in slot b % nslots, so the retention is
+ * nslots buckets back from the newest one. Each slot records the bucket it
+ * holds: a slot left over from an older lap of the ring is simply ignored
+ * and overwritten, which expires old buckets on write at no cost. The
+ * decimals in a slot have room for as many coefficient words as the context
+ * precision needs, the ring is widened if a larger precision is set later. */
+#define BN_SERIES_TYPE_NAME "bn-series"
+#define BN_SERIES_ENCVER 0
+#define BN_SERIES_BUCKET 60000
+#define BN_SERIES_RETENTION 3600000
+#define BN_SERIES_MAX_SLOTS 65536
+#define BN_SVAL_SIZE(words)                                                    \
+    (sizeof(bn_sval_t) + (size_t)(words) * sizeof(mpd_uint_t))
+
+/* The decimals of a slot, in this order after its header. */
+#define BN_SLOT_SUM 0
+#define BN_SLOT_MIN 1
+#define BN_SLOT_MAX 2
+
+typedef struct {
+    int64_t exp;
+    uint32_t len;
+    uint32_t sign;
+} bn_sval_t;
+
+/* bucket is -1 for a slot never written. */
+typedef struct {
+    int64_t bucket;
+    int64_t count;
+} bn_slot_t;
+
+typedef struct {
+    int64_t width;
+    int64_t last;
+    uint32_t nslots;
+    uint32_t words;
+    size_t slotsize;
+    unsigned char *ring;
+} bn_series_t;
+
+static inline void bn_sval_view(const bn_sval_t *v, mpd_t *dec) {
+    dec->flags = MPD_STATIC | MPD_CONST_DATA | (uint8_t)v->sign;
+    dec->exp = (mpd_ssize_t)v->exp;
+    dec->len = dec->alloc = (mpd_ssize_t)v->len;
+    dec->data = (mpd_uint_t *)(v + 1);
+    mpd_setdigits(dec);
+}
+
+static inline void bn_sval_set(bn_sval_t *v, const mpd_t *dec) {
+    v->exp = dec->exp;
+    v->len = (uint32_t)dec->len;
+    v->sign = mpd_sign(dec);
+    memcpy(v + 1, dec->data, (size_t)dec->len * sizeof(mpd_uint_t));
+}
+
+static inline bn_slot_t *bn_series_slot(const bn_series_t *s, int64_t b) {
+    return (bn_slot_t *)(s->ring + (size_t)(b % s->nslots) * s->slotsize);
+}
+
+static inline bn_sval_t *bn_slot_val(const bn_series_t *s, bn_slot_t *slot,
+                                     int i) {
+    return (bn_sval_t *)((unsigned char *)(slot + 1) +
+                         (size_t)i * BN_SVAL_SIZE(s->words));
+}
+
+static inline int64_t bn_series_bucket(const bn_series_t *s, int64_t ts) {
+    return ts / s->width;
+}
+
+static bn_series_t *bn_series_new(int64_t width, uint32_t nslots) {
+    uint32_t i;
+    bn_series_t *s = RedisModule_Calloc(1, sizeof(*s));
+
+    s->width = width;
+    s->last = -1;
+    s->nslots = nslots;
+    s->words = (uint32_t)((mpd_ctx.prec + MPD_RDIGITS - 1) / MPD_RDIGITS);
+    s->slotsize = sizeof(bn_slot_t) + 3 * BN_SVAL_SIZE(s->words);
+    s->ring = RedisModule_Alloc(nslots * s->slotsize);
+    for (i = 0; i < nslots; i++) {
+        bn_series_slot(s, i)->bucket = -1;
+    }
+
+    return s;
+}
+
+static void bn_series_free(void *value) {
+    bn_series_t *s = value;
+
+    RedisModule_Free(s->ring);
+    RedisModule_Free(s);
+}
+
+/* Moves every slot to a ring with room for words coefficient words. */
+static void bn_series_widen(bn_series_t *s, uint32_t words) {
+    uint32_t i;
+    int j;
+    bn_series_t old = *s;
+    bn_slot_t *from, *to;
+
+    s->words = words;
+    s->slotsize = sizeof(bn_slot_t) + 3 * BN_SVAL_SIZE(words);
+    s->ring = RedisModule_Alloc(s->nslots * s->slotsize);
+    for (i = 0; i < s->nslots; i++) {
+        from = bn_series_slot(&old, i);
+        to = bn_series_slot(s, i);
+        *to = *from;
+        for (j = 0; j < 3 && from->bucket >= 0; j++) {
+            memcpy(bn_slot_val(s, to, j), bn_slot_val(&old, from, j),
+                   BN_SVAL_SIZE(bn_slot_val(&old, from, j)->len));
+        }
+    }
+    RedisModule_Free(old.ring);
+}
+
+/* Folds count values with the given sum, min and max into bucket b, which
+ * must not be older than the retention. Returns its slot. */
+static bn_slot_t *bn_series_merge(bn_series_t *s, int64_t b, int64_t count,
+                                  const mpd_t *sum, const mpd_t *min,
+                                  const mpd_t *max) {
+    uint32_t status = 0;
+    int fresh;
+    mpd_ssize_t need;
+    size_t mark = bn_scratch_mark();
+    mpd_t view, *acc;
+    bn_slot_t *slot = bn_series_slot(s, b);
+
+    fresh = slot->bucket != b;
+    if (!fresh) {
+        acc = bn_scratch_new();
+        bn_sval_view(bn_slot_val(s, slot, BN_SLOT_SUM), &view);
+        mpd_qcopy(acc, &view, &status);
+        bn_apply(acc, sum, op_add);
+        sum = acc;
+        bn_sval_view(bn_slot_val(s, slot, BN_SLOT_MIN), &view);
+        if (mpd_cmp(min, &view, &mpd_ctx) >= 0) {
+            min = NULL;
+        }
+        bn_sval_view(bn_slot_val(s, slot, BN_SLOT_MAX), &view);
+        if (mpd_cmp(max, &view, &mpd_ctx) <= 0) {
+            max = NULL;
+        }
+    }
+
+    need = sum->len;
+    if (min != NULL && min->len > need) {
+        need = min->len;
+    }
+    if (max != NULL && max->len > need) {
+        need = max->len;
+    }
+    if (need > (mpd_ssize_t)s->words) {
+        bn_series_widen(s, (uint32_t)need);
+        slot = bn_series_slot(s, b);
+    }
+
+    if (fresh) {
+        slot->bucket = b;
+        slot->count = 0;
+    }
+    bn_sval_set(bn_slot_val(s, slot, BN_SLOT_SUM), sum);
+    if (min != NULL) {
+        bn_sval_set(bn_slot_val(s, slot, BN_SLOT_MIN), min);
+    }
+    if (max != NULL) {
+        bn_sval_set(bn_slot_val(s, slot, BN_SLOT_MAX), max);
+    }
+    slot->count += count;
+    if (b > s->last) {
+        s->last = b;
+    }
+
+    bn_scratch_release(mark);
+
+    return slot;
+}
+
+/* The oldest bucket still retained. */
+static inline int64_t bn_series_first(const bn_series_t *s) {
+    return s->last >= (int64_t)s->nslots ? s->last - s->nslots + 1 : 0;
+}
+
+static int bn_series_lookup(RedisModuleKey *rk, bn_series_t **s) {
+    *s = NULL;
+
+    if (RedisModule_KeyType(rk) == REDISMODULE_KEYTYPE_EMPTY) {
+        return REDISMODULE_OK;
+    }
+
+    if (RedisModule_ModuleTypeGetType(rk) != bn_series_type) {
+        return REDISMODULE_ERR;
+    }
+
+    *s = RedisModule_ModuleTypeGetValue(rk);
+
+    return REDISMODULE_OK;
+}
+
+/* Parses [TS ts] [BUCKET ms] [RETENTION ms] from argv, TS only if ts isn't
+ * NULL, and opens the series at key, creating it with the given bucket
+ * width and retention. Those must match if it exists. Replies with an error
+ * and returns NULL on failure. */
+static bn_series_t *bn_series_open(RedisModuleCtx *ctx, RedisModuleString *key,
+                                   RedisModuleString **argv, int argc,
+                                   long long *ts) {
+    int i;
+    long long width = 0, retention = 0, *opt;
+    const char *val;
+    bn_series_t *s;
+    RedisModuleKey *rk;
+
+    if (argc % 2 != 0) {
+        RedisModule_WrongArity(ctx);
+        return NULL;
+    }
+
+    for (i = 0; i < argc; i += 2) {
+        val = RedisModule_StringPtrLen(argv[i], NULL);
+        if (ts != NULL && !strcasecmp(val, "ts")) {
+            opt = ts;
+        } else if (!strcasecmp(val, "bucket")) {
+            opt = &width;
+        } else if (!strcasecmp(val, "retention")) {
+            opt = &retention;
+        } else {
+            RedisModule_ReplyWithError(ctx, "ERR syntax error");
+            return NULL;
+        }
+        if (RedisModule_StringToLongLong(argv[i + 1], opt) != REDISMODULE_OK ||
+            *opt < 0) {
+            RedisModule_ReplyWithError(
+                ctx, "ERR value is not an integer or out of range");
+            return NULL;
+        }
+    }
+
+    rk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (bn_series_lookup(rk, &s) != REDISMODULE_OK) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return NULL;
+    }
+
+    if (s != NULL) {
+        if ((width != 0 && width != s->width) ||
+            (retention != 0 && retention / s->width != s->nslots)) {
+            RedisModule_ReplyWithError(
+                ctx, "ERR series exists with a different BUCKET or RETENTION");
+            return NULL;
+        }
+        return s;
+    }
+
+    width = width == 0 ? BN_SERIES_BUCKET : width;
+    retention = retention == 0 ? BN_SERIES_RETENTION : retention;
+    if (retention < width || retention / width > BN_SERIES_MAX_SLOTS) {
+        RedisModule_ReplyWithError(
+            ctx, "ERR RETENTION must be 1 to 65536 times BUCKET");
+        return NULL;
+    }
+
+    s = bn_series_new(width, (uint32_t)(retention / width));
+    RedisModule_ModuleTypeSetValue(rk, bn_series_type, s);
+
+    return s;
+}
+
+/* BN.TS.ADD key value [TS ts] [BUCKET ms] [RETENTION ms]
+ *
+ * Adds value to the bucket holding ts, the server time by default. BUCKET
+ * (60000 by default) and RETENTION (3600000) are set when the series is
+ * created. Replies with the sum of the bucket. */
+int cmd_TS_ADD(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    long long ts = -1;
+    int64_t b;
+    size_t len;
+    const char *val;
+    mpd_t *dec, sum;
+    bn_series_t *s;
+    bn_slot_t *slot;
+
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    val = RedisModule_StringPtrLen(argv[2], &len);
+    dec = decimal(val, len, 0);
+    if (dec == NULL) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+    if (mpd_isspecial(dec)) {
+        return RedisModule_ReplyWithError(ctx,
+                                          "ERR value must be a finite decimal");
+    }
+
+    s = bn_series_open(ctx, argv[1], argv + 3, argc - 3, &ts);
+    if (s == NULL) {
+        return REDISMODULE_OK;
+    }
+
+    if (ts < 0) {
+        ts = RedisModule_Milliseconds();
+    }
+    b = bn_series_bucket(s, ts);
+    if (b < bn_series_first(s)) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR timestamp is older than the retention");
+    }
+
+    slot = bn_series_merge(s, b, 1, dec, dec, dec);
+
+    RedisModule_Replicate(ctx, "bn.ts.add", "ssclclcl", argv[1], argv[2],
+                          "TS", ts, "BUCKET", (long long)s->width,
+                          "RETENTION", (long long)(s->width * s->nslots));
+
+    bn_sval_view(bn_slot_val(s, slot, BN_SLOT_SUM), &sum);
+
+    return bn_reply_decimal(ctx, &sum);
+}
+
+/* BN.TS.MERGE key ts count sum min max [BUCKET ms] [RETENTION ms]
+ *
+ * Folds pre-aggregated values into the bucket holding ts, as if the count
+ * values had been added one by one. Used to rewrite the AOF. */
+int cmd_TS_MERGE(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i;
+    long long ts, count;
+    int64_t b;
+    size_t len;
+    const char *val;
+    mpd_t *dec[3];
+    bn_series_t *s;
+
+    if (argc < 7) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (RedisModule_StringToLongLong(argv[2], &ts) != REDISMODULE_OK ||
+        RedisModule_StringToLongLong(argv[3], &count) != REDISMODULE_OK ||
+        ts < 0 || count < 1) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR value is not an integer or out of range");
+    }
+
+    for (i = 0; i < 3; i++) {
+        val = RedisModule_StringPtrLen(argv[4 + i], &len);
+        dec[i] = decimal(val, len, 0);
+        if (dec[i] == NULL) {
+            return RedisModule_ReplyWithError(ctx,
+                                              REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+        if (mpd_isspecial(dec[i])) {
+            return RedisModule_ReplyWithError(
+                ctx, "ERR value must be a finite decimal");
+        }
+    }
+    if (mpd_cmp(dec[1], dec[2], &mpd_ctx) > 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR min is greater than max");
+    }
+
+    s = bn_series_open(ctx, argv[1], argv + 7, argc - 7, NULL);
+    if (s == NULL) {
+        return REDISMODULE_OK;
+    }
+
+    b = bn_series_bucket(s, ts);
+    if (b < bn_series_first(s)) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR timestamp is older than the retention");
+    }
+
+    bn_series_merge(s, b, count, dec[0], dec[1], dec[2]);
+
+    RedisModule_ReplicateVerbatim(ctx);
+
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* BN.TS.RANGE key start end [WINDOW ms]
+ *
+ * Replies with a [start, count, sum, min, max] array for every window of
+ * the given width, the bucket width by default, that has values between
+ * start and end. start and end may be - and +. A window must be a multiple
+ * of the bucket width, windows are aligned on multiples of it. The retained
+ * buckets are walked once in ring order. */
+int cmd_TS_RANGE(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    uint32_t status = 0;
+    long long window = 0;
+    long n = 0;
+    int64_t start, end, b, lo, hi, k, w, cur = -1, count = 0;
+    mpd_t view, min, max, *sum;
+    bn_series_t *s;
+    bn_slot_t *slot;
+    RedisModuleKey *rk;
+
+    if (argc != 4 && argc != 6) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (bn_time_bound(argv[2], &start) != REDISMODULE_OK ||
+        bn_time_bound(argv[3], &end) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR start or end is not a timestamp");
+    }
+    if (argc == 6) {
+        if (strcasecmp(RedisModule_StringPtrLen(argv[4], NULL), "window")) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        if (RedisModule_StringToLongLong(argv[5], &window) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(
+                ctx, "ERR value is not an integer or out of range");
+        }
+    }
+
+    rk = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (bn_series_lookup(rk, &s) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+    if (s == NULL) {
+        return RedisModule_ReplyWithArray(ctx, 0);
+    }
+
+    window = window == 0 && argc == 4 ? s->width : window;
+    if (window <= 0 || window % s->width != 0) {
+        return RedisModule_ReplyWithError(
+            ctx, "ERR WINDOW must be a multiple of the bucket width");
+    }
+    k = window / s->width;
+
+    lo = start < 0 ? 0 : bn_series_bucket(s, start);
+    hi = end < 0 ? -1 : bn_series_bucket(s, end);
+    if (lo < bn_series_first(s)) {
+        lo = bn_series_first(s);
+    }
+    if (hi > s->last) {
+        hi = s->last;
+    }
+
+    sum = bn_scratch_new();
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+
+    for (b = lo; b <= hi + 1; b++) {
+        slot = b <= hi ? bn_series_slot(s, b) : NULL;
+        if (slot != NULL && slot->bucket != b) {
+            continue;
+        }
+
+        w = slot != NULL ? b / k : -1;
+        if (w != cur && cur >= 0) {
+            RedisModule_ReplyWithArray(ctx, 5);
+            RedisModule_ReplyWithLongLong(ctx, cur * window);
+            RedisModule_ReplyWithLongLong(ctx, count);
+            bn_reply_decimal(ctx, sum);
+            bn_reply_decimal(ctx, &min);
+            bn_reply_decimal(ctx, &max);
+            n++;
+        }
+        if (slot == NULL) {
+            break;
+        }
+
+        bn_sval_view(bn_slot_val(s, slot, BN_SLOT_SUM), &view);
+        if (w != cur) {
+            cur = w;
+            count = slot->count;
+            mpd_qcopy(sum, &view, &status);
+            bn_sval_view(bn_slot_val(s, slot, BN_SLOT_MIN), &min);
+            bn_sval_view(bn_slot_val(s, slot, BN_SLOT_MAX), &max);
+            continue;
+        }
+
+        count += slot->count;
+        bn_apply(sum, &view, op_add);
+        bn_sval_view(bn_slot_val(s, slot, BN_SLOT_MIN), &view);
+        if (mpd_cmp(&view, &min, &mpd_ctx) < 0) {
+            min = view;
+        }
+        bn_sval_view(bn_slot_val(s, slot, BN_SLOT_MAX), &view);
+        if (mpd_cmp(&view, &max, &mpd_ctx) > 0) {
+            max = view;
+        }
+    }
+
+    RedisModule_ReplySetArrayLength(ctx, n);
+
+    return REDISMODULE_OK;
+}
+
+/* Background migration of values written by earlier versions, see
+ * BN.MIGRATE. A timer walks the keyspace of one db with SCAN and converts
+ * the keys of each batch one at a time, checking BN_MIGRATE_BUDGET_NS before
+ * each key and picking up the rest of the batch on the next tick. Strings go
+ * through BN.MIGRATE KEY and hash fields through HSET, both called with
+ * RedisModule_Call() so the conversion is replicated like any write. A hash
+ * is walked with HSCAN a few fields at a time, so a large one spans ticks
+ * too.
+ *
+ * Only values that bn_format() gives back byte for byte are touched, so a
+ * conversion never changes what a client reads: "02134", "1E+2" or "NaN"
+ * are left alone, and hash fields are only ever rewritten by REDUCE. */
+#define BN_MIGRATE_PERIOD_MS 10
+#define BN_MIGRATE_BUDGET_NS 1000000
+#define BN_MIGRATE_COUNT 32
+#define BN_MIGRATE_RATE 10000
+
+typedef struct {
+    size_t len;
+    char *name;
+} bn_migrate_name_t;
+
+typedef struct {
+    int running;
+    int reduce;
+    int db;
+    long long rate;
+    char *match;
+    char cursor[32];
+    /* Keys of the last SCAN reply, batch[next] is the one in progress and
+     * hcursor the HSCAN cursor within it when it is a hash. */
+    bn_migrate_name_t *batch;
+    size_t nbatch;
+    size_t next;
+    int last;
+    char hcursor[32];
+    long long scanned;
+    long long reencoded;
+    long long started;
+    long long finished;
+    RedisModuleTimerID timer;
+} bn_migrate_t;
+
+static bn_migrate_t bn_migrate = {.cursor = "0", .hcursor = "0"};
+
+/* Strips the trailing zeros after the decimal point, 1.50 to 1.5 and 2.00
+ * to 2, leaving integers alone. */
+static inline void bn_migrate_reduce(mpd_t *dec) {
+    uint32_t status = 0;
+
+    if (mpd_isspecial(dec) || dec->exp >= 0) {
+        return;
+    }
+
+    mpd_qreduce(dec, dec, &mpd_ctx, &status);
+    if (dec->exp > 0) {
+        bn_rescale(dec, dec, 0);
+    }
+}
+
+/* Parses a stored value, or returns NULL unless it is a finite number in
+ * exactly the form bn_format() writes. With reduce, the trailing zeros after
+ * the decimal point are stripped from the result. */
+static inline mpd_t *bn_migrate_parse(const char *s, size_t len, int reduce) {
+    size_t flen;
+    char *str;
+    mpd_t *dec;
+
+    dec = decimal(s, len, 0);
+    if (dec == NULL || mpd_isspecial(dec)) {
+        return NULL;
+    }
+
+    flen = bn_format(dec, &str);
+    if (flen != len || memcmp(str, s, len)) {
+        return NULL;
+    }
+
+    if (reduce) {
+        bn_migrate_reduce(dec);
+    }
+
+    return dec;
+}
+
+/* The new form of a hash field with REDUCE, or NULL if it stays as is. */
+static inline RedisModuleString *bn_migrate_field(RedisModuleCtx *ctx,
+                                                  const char *val,
+                                                  size_t len) {
+    size_t flen;
+    char *str;
+    mpd_t *dec;
+
+    dec = bn_migrate_parse(val, len, 1);
+    if (dec == NULL) {
+        return NULL;
+    }
+
+    flen = bn_format(dec, &str);
+    if (flen == len && !memcmp(str, val, len)) {
+        return NULL;
+    }
+
+    return RedisModule_CreateString(ctx, str, flen);
+}
+
+/* Re-encodes the value at key, or with reduce every field of the hash at
+ * key, and returns how many values were rewritten. The new values are
+ * replicated, not the command, see bn_replicate_value(). */
+static long long bn_migrate_key(RedisModuleCtx *ctx, RedisModuleString *key,
+                                int reduce) {
+    long long n = 0;
+    mstime_t ttl;
+    mpd_ssize_t exp;
+    size_t i, len, mark;
+    const char *val;
+    mpd_t *dec;
+    bn_value_t *v;
+    RedisModuleKey *rk;
+    RedisModuleString *str, *name;
+    RedisModuleCallReply *reply, *field;
+
+    rk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ | REDISMODULE_WRITE);
+
+    switch (RedisModule_KeyType(rk)) {
+    case REDISMODULE_KEYTYPE_STRING:
+        val = RedisModule_StringDMA(rk, &len, REDISMODULE_READ);
+        dec = bn_migrate_parse(val, len, reduce);
+        if (dec == NULL) {
+            break;
+        }
+
+        /* Setting the value drops the TTL, put it back. */
+        ttl = RedisModule_GetExpire(rk);
+        v = bn_value_new();
+        mpd_copy(&v->dec, dec, &mpd_ctx);
+        RedisModule_ModuleTypeSetValue(rk, bn_type, v);
+        if (ttl != REDISMODULE_NO_EXPIRE) {
+            RedisModule_SetExpire(rk, ttl);
+        }
+        bn_replicate_value(ctx, NULL, key, &v->dec);
+        n = 1;
+        break;
+
+    case REDISMODULE_KEYTYPE_MODULE:
+        v = bn_value_lookup(rk, 0);
+        if (v != NULL && reduce) {
+            exp = v->dec.exp;
+            bn_migrate_reduce(&v->dec);
+            bn_value_compact(v);
+            n = v->dec.exp != exp;
+            if (n) {
+                bn_replicate_value(ctx, NULL, key, &v->dec);
+            }
+        }
+        break;
+
+    case REDISMODULE_KEYTYPE_HASH:
+        if (!reduce) {
+            break;
+        }
+        reply = RedisModule_Call(ctx, "HGETALL", "s", key);
+        if (reply == NULL ||
+            RedisModule_CallReplyType(reply) != REDISMODULE_REPLY_ARRAY) {
+            break;
+        }
+        mark = bn_scratch_mark();
+        for (i = 0; i + 1 < RedisModule_CallReplyLength(reply); i += 2) {
+            field = RedisModule_CallReplyArrayElement(reply, i);
+            val = RedisModule_CallReplyStringPtr(
+                RedisModule_CallReplyArrayElement(reply, i + 1), &len);
+            str = bn_migrate_field(ctx, val, len);
+            if (str != NULL) {
+                name = RedisModule_CreateStringFromCallReply(field);
+                RedisModule_HashSet(rk, REDISMODULE_HASH_NONE, name, str,
+                                    NULL);
+                RedisModule_Replicate(ctx, "HSET", "sss", key, name, str);
+                n++;
+            }
+            bn_scratch_release(mark);
+        }
+        break;
+    }
+
+    return n;
+}
+
+static void bn_migrate_batch_free(void) {
+    size_t i;
+
+    for (i = 0; i < bn_migrate.nbatch; i++) {
+        RedisModule_Free(bn_migrate.batch[i].name);
+    }
+    RedisModule_Free(bn_migrate.batch);
+    bn_migrate.batch = NULL;
+    bn_migrate.nbatch = 0;
+    bn_migrate.next = 0;
+    strcpy(bn_migrate.hcursor, "0");
+}
+
+static void bn_migrate_finish(void) {
+    bn_migrate_batch_free();
+    bn_migrate.running = 0;
+    bn_migrate.finished = RedisModule_Milliseconds();
+}
+
+/* Copies a cursor from a SCAN or HSCAN reply, or returns REDISMODULE_ERR if
+ * the reply isn't one. */
+static int bn_migrate_cursor(RedisModuleCallReply *reply, char *cursor) {
+    size_t len;
+    const char *str;
+
+    if (reply == NULL ||
+        RedisModule_CallReplyType(reply) != REDISMODULE_REPLY_ARRAY ||
+        RedisModule_CallReplyLength(reply) != 2) {
+        return REDISMODULE_ERR;
+    }
+
+    str = RedisModule_CallReplyStringPtr(
+        RedisModule_CallReplyArrayElement(reply, 0), &len);
+    if (str == NULL || len >= sizeof(bn_migrate.cursor)) {
+        return REDISMODULE_ERR;
+    }
+    memcpy(cursor, str, len);
+    cursor[len] = '\0';
+
+    return REDISMODULE_OK;
+}
+
+/* Fetches the next SCAN batch into bn_migrate.batch. */
+static int bn_migrate_scan(RedisModuleCtx *ctx) {
+    size_t i, n, len;
+    const char *name;
+    RedisModuleCallReply *reply, *keys;
+
+    reply = RedisModule_Call(ctx, "SCAN", "ccccl", bn_migrate.cursor, "MATCH",
+                             bn_migrate.match, "COUNT",
+                             (long long)BN_MIGRATE_COUNT);
+    if (bn_migrate_cursor(reply, bn_migrate.cursor) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    bn_migrate.last = !strcmp(bn_migrate.cursor, "0");
+
+    bn_migrate_batch_free();
+    keys = RedisModule_CallReplyArrayElement(reply, 1);
+    n = RedisModule_CallReplyLength(keys);
+    bn_migrate.batch = RedisModule_Alloc(sizeof(*bn_migrate.batch) * (n + 1));
+    for (i = 0; i < n; i++) {
+        name = RedisModule_CallReplyStringPtr(
+            RedisModule_CallReplyArrayElement(keys, i), &len);
+        bn_migrate.batch[i].name = RedisModule_Alloc(len + 1);
+        memcpy(bn_migrate.batch[i].name, name, len);
+        bn_migrate.batch[i].len = len;
+    }
+    bn_migrate.nbatch = n;
+
+    return REDISMODULE_OK;
+}
+
+/* Rewrites the fields of the hash at key from bn_migrate.hcursor on until
+ * the budget runs out. Returns 1 once the whole hash was walked. */
+static int bn_migrate_hash(RedisModuleCtx *ctx, RedisModuleString *key,
+                           uint64_t start) {
+    size_t i, n, len;
+    const char *val;
+    RedisModuleString *str;
+    RedisModuleCallReply *reply, *fields, *field;
+
+    do {
+        reply = RedisModule_Call(ctx, "HSCAN", "sccl", key, bn_migrate.hcursor,
+                                 "COUNT", (long long)BN_MIGRATE_COUNT);
+        if (bn_migrate_cursor(reply, bn_migrate.hcursor) != REDISMODULE_OK) {
+            return 1;
+        }
+
+        fields = RedisModule_CallReplyArrayElement(reply, 1);
+        n = RedisModule_CallReplyLength(fields);
+        for (i = 0; i + 1 < n; i += 2) {
+            bn_scratch_reset();
+            field = RedisModule_CallReplyArrayElement(fields, i);
+            val = RedisModule_CallReplyStringPtr(
+                RedisModule_CallReplyArrayElement(fields, i + 1), &len);
+            str = val != NULL ? bn_migrate_field(ctx, val, len) : NULL;
+            if (str != NULL) {
+                RedisModule_Call(ctx, "HSET", "!sss", key,
+                                 RedisModule_CreateStringFromCallReply(field),
+                                 str);
+                bn_migrate.reencoded++;
+            }
+        }
+
+        if (!strcmp(bn_migrate.hcursor, "0")) {
+            return 1;
+        }
+    } while (bn_now_ns() - start < BN_MIGRATE_BUDGET_NS);
+
+    return 0;
+}
+
+static void bn_migrate_step(RedisModuleCtx *ctx, void *data) {
+    int type;
+    long long quota, done = 0;
+    uint64_t start = bn_now_ns();
+    bn_migrate_name_t *name;
+    RedisModuleKey *rk;
+    RedisModuleString *key;
+    RedisModuleCallReply *reply;
+
+    REDISMODULE_NOT_USED(data);
+
+    RedisModule_AutoMemory(ctx);
+    RedisModule_SelectDb(ctx, bn_migrate.db);
+
+    quota = bn_migrate.rate * BN_MIGRATE_PERIOD_MS / 1000;
+    if (quota < 1) {
+        quota = 1;
+    }
+
+    while (done < quota && bn_now_ns() - start < BN_MIGRATE_BUDGET_NS) {
+        if (bn_migrate.next == bn_migrate.nbatch) {
+            if (bn_migrate.last) {
+                bn_migrate_finish();
+                RedisModule_Log(ctx, "notice",
+                                "bn.migrate: done, %lld keys scanned, %lld "
+                                "values re-encoded",
+                                bn_migrate.scanned, bn_migrate.reencoded);
+                return;
+            }
+            if (bn_migrate_scan(ctx) != REDISMODULE_OK) {
+                bn_migrate_finish();
+                RedisModule_Log(ctx, "warning", "bn.migrate: SCAN failed");
+                return;
+            }
+            continue;
+        }
+
+        name = &bn_migrate.batch[bn_migrate.next];
+        key = RedisModule_CreateString(ctx, name->name, name->len);
+        rk = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
+        type = RedisModule_KeyType(rk);
+        RedisModule_CloseKey(rk);
+
+        if (type == REDISMODULE_KEYTYPE_HASH) {
+            if (bn_migrate.reduce && !bn_migrate_hash(ctx, key, start)) {
+                continue;
+            }
+        } else if (type == REDISMODULE_KEYTYPE_STRING ||
+                   type == REDISMODULE_KEYTYPE_MODULE) {
+            if (bn_migrate.reduce) {
+                reply = RedisModule_Call(ctx, "bn.migrate", "!csc", "KEY", key,
+                                         "REDUCE");
+            } else {
+                reply = RedisModule_Call(ctx, "bn.migrate", "!cs", "KEY", key);
+            }
+            if (reply != NULL &&
+                RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_INTEGER) {
+                bn_migrate.reencoded += RedisModule_CallReplyInteger(reply);
+            }
+        }
+
+        strcpy(bn_migrate.hcursor, "0");
+        bn_migrate.next++;
+        bn_migrate.scanned++;
+        done++;
+    }
+
+    bn_migrate.timer = RedisModule_CreateTimer(ctx, BN_MIGRATE_PERIOD_MS,
+                                               bn_migrate_step, NULL);
+}
+
+static int bn_migrate_status(RedisModuleCtx *ctx) {
+    long long end = bn_migrate.running ? RedisModule_Milliseconds()
+                                       : bn_migrate.finished;
+
+    RedisModule_ReplyWithArray(ctx, 18);
+    RedisModule_ReplyWithSimpleString(ctx, "running");
+    RedisModule_ReplyWithLongLong(ctx, bn_migrate.running);
+    RedisModule_ReplyWithSimpleString(ctx, "db");
+    RedisModule_ReplyWithLongLong(ctx, bn_migrate.db);
+    RedisModule_ReplyWithSimpleString(ctx, "match");
+    if (bn_migrate.match != NULL) {
+        RedisModule_ReplyWithStringBuffer(ctx, bn_migrate.match,
+                                          strlen(bn_migrate.match));
+    } else {
+        RedisModule_ReplyWithNull(ctx);
+    }
+    RedisModule_ReplyWithSimpleString(ctx, "rate");
+    RedisModule_ReplyWithLongLong(ctx, bn_migrate.rate);
+    RedisModule_ReplyWithSimpleString(ctx, "reduce");
+    RedisModule_ReplyWithLongLong(ctx, bn_migrate.reduce);
+    RedisModule_ReplyWithSimpleString(ctx, "cursor");
+    RedisModule_ReplyWithStringBuffer(ctx, bn_migrate.cursor,
+                                      strlen(bn_migrate.cursor));
+    RedisModule_ReplyWithSimpleString(ctx, "scanned");
+    RedisModule_ReplyWithLongLong(ctx, bn_migrate.scanned);
+    RedisModule_ReplyWithSimpleString(ctx, "reencoded");
+    RedisModule_ReplyWithLongLong(ctx, bn_migrate.reencoded);
+    RedisModule_ReplyWithSimpleString(ctx, "elapsed-ms");
+    RedisModule_ReplyWithLongLong(
+        ctx, bn_migrate.started != 0 ? end - bn_migrate.started : 0);
+
+    return REDISMODULE_OK;
+}
+
+/* BN.MIGRATE START [MATCH pattern] [RATE keys/s] [REDUCE]
+ * BN.MIGRATE STATUS
+ * BN.MIGRATE STOP
+ * BN.MIGRATE KEY key [REDUCE]
+ *
+ * START walks the keys of the selected db matching pattern in the
+ * background, RATE keys per second at most (10000 by default). MATCH is
+ * required: every matched string holding a number becomes a native value,
+ * which GET, INCR or APPEND then fail on with WRONGTYPE, so the pattern
+ * must only cover keys used through the bn.* commands. REDUCE also strips
+ * the trailing zeros after the decimal point, of native values and hash
+ * fields too, so e.g. BN.GET replies 1.5 rather than 1.50. KEY converts a
+ * single key and replies with the number of values rewritten. */
+int cmd_MIGRATE(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i, reduce = 0;
+    long long n, rate = BN_MIGRATE_RATE;
+    size_t len;
+    const char *sub, *opt, *match = NULL;
+
+    if (argc < 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    sub = RedisModule_StringPtrLen(argv[1], NULL);
+
+    if (RedisModule_IsKeysPositionRequest(ctx)) {
+        if (!strcasecmp(sub, "key") && argc >= 3) {
+            RedisModule_KeyAtPos(ctx, 2);
+        }
+        return REDISMODULE_OK;
+    }
+
+    if (!strcasecmp(sub, "status") && argc == 2) {
+        return bn_migrate_status(ctx);
+    }
+
+    if (!strcasecmp(sub, "stop") && argc == 2) {
+        if (bn_migrate.running) {
+            RedisModule_StopTimer(ctx, bn_migrate.timer, NULL);
+            bn_migrate_finish();
+        }
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+
+    if (!strcasecmp(sub, "key") && (argc == 3 || argc == 4)) {
+        if (argc == 4) {
+            if (strcasecmp(RedisModule_StringPtrLen(argv[3], NULL),
+                           "reduce")) {
+                return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+            }
+            reduce = 1;
+        }
+        n = bn_migrate_key(ctx, argv[2], reduce);
+        return RedisModule_ReplyWithLongLong(ctx, n);
+    }
+
+    if (strcasecmp(sub, "start")) {
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+    }
+
+    for (i = 2; i < argc; i++) {
+        opt = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(opt, "reduce")) {
+            reduce = 1;
+        } else if (!strcasecmp(opt, "match") && i + 1 < argc) {
+            match = RedisModule_StringPtrLen(argv[++i], &len);
+        } else if (!strcasecmp(opt, "rate") && i + 1 < argc) {
+            if (RedisModule_StringToLongLong(argv[++i], &rate) !=
+                    REDISMODULE_OK ||
+                rate < 1) {
+                return RedisModule_ReplyWithError(
+                    ctx, "ERR value is not an integer or out of range");
+            }
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+    }
+
+    if (match == NULL) {
+        return RedisModule_ReplyWithError(ctx, "ERR MATCH pattern required");
+    }
+
+    if (bn_migrate.running) {
+        return RedisModule_ReplyWithError(ctx,
+                                          "ERR a migration is already running");
+    }
+
+    RedisModule_Free(bn_migrate.match);
+    bn_migrate.match = RedisModule_Alloc(len + 1);
+    memcpy(bn_migrate.match, match, len + 1);
+    bn_migrate.running = 1;
+    bn_migrate.reduce = reduce;
+    bn_migrate.db = RedisModule_GetSelectedDb(ctx);
+    bn_migrate.rate = rate;
+    strcpy(bn_migrate.cursor, "0");
+    bn_migrate.last = 0;
+    bn_migrate.scanned = 0;
+    bn_migrate.reencoded = 0;
+    bn_migrate.started = RedisModule_Milliseconds();
+    bn_migrate.finished = 0;
+    bn_migrate.timer = RedisModule_CreateTimer(ctx, BN_MIGRATE_PERIOD_MS,
+                                               bn_migrate_step, NULL);
+
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* Context parameters, set from the module arguments (e.g. loadmodule
+ * bignumber.so precision 18 rounding half_even) or with BN.CONFIG SET.
+ * Like CONFIG SET, changes aren't replicated, so a replica or an AOF replay
+ * may run with another context. Writes are therefore replicated as the
+ * values they stored (BN.SET, HSET, SET, BN.ZADD), never as the command
+ * that computed them, and a replica stores exactly what the master did as
+ * long as its precision is at least the master's. Ledger and series appends
+ * are the exception: they replicate the delta or sample and sum it again,
+ * so those keys also need the same context. The scratch pools and series
+ * slots are sized by the precision, so it is capped at BN_PREC_MAX digits,
+ * and emax and emin at BN_EXP_MAX in magnitude. */
+#define BN_PREC_MAX 4096
+#define BN_EXP_MAX 999999
+
+static const char *bn_config_params[] = {
+    "precision",        "rounding",           "emax",
+    "emin",             "offload-threshold",  "workers",
+    "counter-flush-ms", "idempotency-ttl-ms", "idempotency-max-entries"};
+
+/* Indexed by the MPD_ROUND_* constants. */
+static const char *bn_round_names[MPD_ROUND_GUARD] = {
+    "up",        "down",      "ceiling", "floor", "half_up",
+    "half_down", "half_even", "05up",    "trunc"};
+
+/* Picks the arithmetic engine for the context precision and makes the
+ * scratch pools sized for the previous one rebuild themselves. */
+static void bn_config_update(void) {
+    bn_engine = bn_engine_mpd;
+#ifdef BN_HAVE_INT128
+    if (mpd_ctx.prec <= MPD_RDIGITS) {
+        bn_engine = bn_engine_word;
+    } else if (mpd_ctx.prec <= BN_FIXED_DIGITS) {
+        bn_engine = bn_engine_int128;
+    }
+#endif
+
+    bn_config_gen++;
+}
+
+/* Validates and applies one parameter, mpd_ctx is left untouched on error
+ * and *err is set to the error reply. */
+static int bn_config_set(const char *name, RedisModuleString *value,
+                         const char **err) {
+    int i, ok;
+    long long ll;
+    const char *val;
+    mpd_context_t ctx = mpd_ctx;
+
+    if (!strcasecmp(name, "offload-threshold") ||
+        !strcasecmp(name, "workers") ||
+        !strcasecmp(name, "counter-flush-ms") ||
+        !strcasecmp(name, "idempotency-ttl-ms") ||
+        !strcasecmp(name, "idempotency-max-entries")) {
+        if (RedisModule_StringToLongLong(value, &ll) != REDISMODULE_OK) {
+            *err = "ERR value is not an integer or out of range";
+            return REDISMODULE_ERR;
+        }
+        if (!strcasecmp(name, "offload-threshold")) {
+            if (ll < 0) {
+                *err = "ERR invalid config value";
+                return REDISMODULE_ERR;
+            }
+            bn_offload_threshold = ll;
+        } else if (!strcasecmp(name, "counter-flush-ms")) {
+            if (ll < 1) {
+                *err = "ERR invalid config value";
+                return REDISMODULE_ERR;
+            }
+            bn_counter_flush_ms = ll;
+        } else if (!strcasecmp(name, "idempotency-ttl-ms")) {
+            if (ll < 1 || ll > BN_IDEM_TTL_MAX) {
+                *err = "ERR invalid config value";
+                return REDISMODULE_ERR;
+            }
+            bn_idem_ttl_ms = ll;
+        } else if (!strcasecmp(name, "idempotency-max-entries")) {
+            if (ll < 1) {
+                *err = "ERR invalid config value";
+                return REDISMODULE_ERR;
+            }
+            bn_idem_max_entries = ll;
+        } else {
+            if (ll < 1 || ll > BN_WORKERS_MAX) {
+                *err = "ERR invalid config value";
+                return REDISMODULE_ERR;
+            }
+            if (bn_pool.started) {
+                *err = "ERR workers can't be changed once the pool is running";
+                return REDISMODULE_ERR;
+            }
+            bn_workers = ll;
+        }
+        return REDISMODULE_OK;
+    }
+
+    if (!strcasecmp(name, "rounding")) {
+        val = RedisModule_StringPtrLen(value, NULL);
+        for (i = 0; i < MPD_ROUND_GUARD; i++) {
+            if (!strcasecmp(val, bn_round_names[i])) {
+                break;
+            }
+        }
+        ok = i < MPD_ROUND_GUARD && mpd_qsetround(&ctx, i);
+    } else if (!strcasecmp(name, "precision") || !strcasecmp(name, "emax") ||
+               !strcasecmp(name, "emin")) {
+        if (RedisModule_StringToLongLong(value, &ll) != REDISMODULE_OK) {
+            *err = "ERR value is not an integer or out of range";
+            return REDISMODULE_ERR;
+        }
+        if (ll < -BN_EXP_MAX || ll > BN_EXP_MAX) {
+            ok = 0;
+        } else if (!strcasecmp(name, "precision")) {
+            ok = ll <= BN_PREC_MAX && mpd_qsetprec(&ctx, (mpd_ssize_t)ll);
+        } else if (!strcasecmp(name, "emax")) {
+            ok = mpd_qsetemax(&ctx, (mpd_ssize_t)ll);
+        } else {
+            ok = mpd_qsetemin(&ctx, (mpd_ssize_t)ll);
+        }
+    } else {
+        *err = "ERR unknown config parameter";
+        return REDISMODULE_ERR;
+    }
+
+    if (!ok) {
+        *err = "ERR invalid config value";
+        return REDISMODULE_ERR;
+    }
+
+    mpd_ctx = ctx;
+    bn_config_update();
+
+    return REDISMODULE_OK;
+}
+
+static inline void bn_config_reply(RedisModuleCtx *ctx, const char *name) {
+    int len;
+    char buf[32];
+    long long val;
+
+    RedisModule_ReplyWithStringBuffer(ctx, name, strlen(name));
+
+    if (!strcmp(name, "rounding")) {
+        name = bn_round_names[mpd_ctx.round];
+        RedisModule_ReplyWithStringBuffer(ctx, name, strlen(name));
+        return;
+    }
+
+    if (!strcmp(name, "precision")) {
+        val = mpd_ctx.prec;
+    } else if (!strcmp(name, "emax")) {
+        val = mpd_ctx.emax;
+    } else if (!strcmp(name, "emin")) {
+        val = mpd_ctx.emin;
+    } else if (!strcmp(name, "offload-threshold")) {
+        val = bn_offload_threshold;
+    } else if (!strcmp(name, "counter-flush-ms")) {
+        val = bn_counter_flush_ms;
+    } else if (!strcmp(name, "idempotency-ttl-ms")) {
+        val = bn_idem_ttl_ms;
+    } else if (!strcmp(name, "idempotency-max-entries")) {
+        val = bn_idem_max_entries;
+    } else {
+        val = bn_workers;
+    }
+
+    len = snprintf(buf, sizeof(buf), "%lld", val);
+    RedisModule_ReplyWithStringBuffer(ctx, buf, (size_t)len);
+}
+
+/* BN.CONFIG GET <parameter|*>, BN.CONFIG SET <parameter> <value>
+ *
+ * Not replicated, see bn_config_params for what that means for replicas. */
+int cmd_CONFIG(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    size_t i, n;
+    const char *sub, *name, *err;
+
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    sub = RedisModule_StringPtrLen(argv[1], NULL);
+    name = RedisModule_StringPtrLen(argv[2], NULL);
+
+    if (!strcasecmp(sub, "get") && argc == 3) {
+        n = sizeof(bn_config_params) / sizeof(bn_config_params[0]);
+        if (strcmp(name, "*")) {
+            for (i = 0; i < n; i++) {
+                if (!strcasecmp(name, bn_config_params[i])) {
+                    break;
+                }
+            }
+            if (i == n) {
+                return RedisModule_ReplyWithArray(ctx, 0);
+            }
+            RedisModule_ReplyWithArray(ctx, 2);
+            bn_config_reply(ctx, bn_config_params[i]);
+            return REDISMODULE_OK;
+        }
+
+        RedisModule_ReplyWithArray(ctx, (long)(2 * n));
+        for (i = 0; i < n; i++) {
+            bn_config_reply(ctx, bn_config_params[i]);
+        }
+        return REDISMODULE_OK;
+    }
+
+    if (!strcasecmp(sub, "set") && argc == 4) {
+        if (bn_config_set(name, argv[3], &err) != REDISMODULE_OK) {
+            return RedisModule_ReplyWithError(ctx, err);
+        }
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+
+    return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+}
+
+/* The p-quantile of a histogram with n samples, as the highest value of the
+ * bucket it falls into, capped by the largest sample. */
+static uint64_t bn_hist_quantile(const uint64_t *hist, uint64_t n, double p,
+                                 uint64_t max) {
+    int i;
+    uint64_t seen = 0, rank = (uint64_t)(p * (double)n + 0.5);
+
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < BN_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    return i < BN_HIST_BUCKETS && bn_hist_value(i) < max ? bn_hist_value(i)
+                                                         : max;
+}
+
+static void bn_stats_reply_command(RedisModuleCtx *ctx, int cmd) {
+    int i;
+    uint64_t calls = 0, nanos = 0, max = 0;
+    uint64_t hist[BN_HIST_BUCKETS] = {0};
+    bn_stats_t *stats;
+
+    for (stats = bn_stats_all; stats != NULL; stats = stats->next) {
+        calls += stats->calls[cmd];
+        nanos += stats->nanos[cmd];
+        if (stats->max[cmd] > max) {
+            max = stats->max[cmd];
+        }
+        for (i = 0; i < BN_HIST_BUCKETS; i++) {
+            hist[i] += stats->hist[cmd][i];
+        }
+    }
+
+    RedisModule_ReplyWithArray(ctx, 13);
+    RedisModule_ReplyWithSimpleString(ctx, bn_command_names[cmd]);
+    RedisModule_ReplyWithSimpleString(ctx, "calls");
+    RedisModule_ReplyWithLongLong(ctx, (long long)calls);
+    RedisModule_ReplyWithSimpleString(ctx, "total_ns");
+    RedisModule_ReplyWithLongLong(ctx, (long long)nanos);
+    RedisModule_ReplyWithSimpleString(ctx, "p50_ns");
+    RedisModule_ReplyWithLongLong(
+        ctx, (long long)bn_hist_quantile(hist, calls, 0.5, max));
+    RedisModule_ReplyWithSimpleString(ctx, "p99_ns");
+    RedisModule_ReplyWithLongLong(
+        ctx, (long long)bn_hist_quantile(hist, calls, 0.99, max));
+    RedisModule_ReplyWithSimpleString(ctx, "p999_ns");
+    RedisModule_ReplyWithLongLong(
+        ctx, (long long)bn_hist_quantile(hist, calls, 0.999, max));
+    RedisModule_ReplyWithSimpleString(ctx, "max_ns");
+    RedisModule_ReplyWithLongLong(ctx, (long long)max);
+}
+
+/* BN.STATS [RESET]
+ * Replies "commands", an entry per command called so far (name, calls,
+ * total_ns, p50_ns, p99_ns, p999_ns, max_ns), then "events", the slow-path
+ * counters as name/count pairs. */
+int cmd_STATS(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    bn_scratch_reset();
+
+    int i, n;
+    long long count;
+    const char *sub;
+    bn_stats_t *stats;
+
+    if (argc > 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    if (argc == 2) {
+        sub = RedisModule_StringPtrLen(argv[1], NULL);
+        if (strcasecmp(sub, "reset")) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        pthread_mutex_lock(&bn_stats_lock);
+        for (stats = bn_stats_all; stats != NULL; stats = stats->next) {
+            memset(stats, 0, offsetof(bn_stats_t, next));
+        }
+        pthread_mutex_unlock(&bn_stats_lock);
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+
+    pthread_mutex_lock(&bn_stats_lock);
+
+    RedisModule_ReplyWithArray(ctx, 4);
+    RedisModule_ReplyWithSimpleString(ctx, "commands");
+
+    for (i = 0, n = 0; i < bn_cmd_count; i++) {
+        for (stats = bn_stats_all; stats != NULL; stats = stats->next) {
+            if (stats->calls[i] != 0) {
+                n++;
+                break;
+            }
+        }
+    }
+
+    RedisModule_ReplyWithArray(ctx, n);
+    for (i = 0; i < bn_cmd_count; i++) {
+        for (stats = bn_stats_all; stats != NULL; stats = stats->next) {
+            if (stats->calls[i] != 0) {
+                bn_stats_reply_command(ctx, i);
+                break;
+            }
+        }
+    }
+
+    RedisModule_ReplyWithSimpleString(ctx, "events");
+    RedisModule_ReplyWithArray(ctx, 2 * bn_event_count);
+    for (i = 0; i < bn_event_count; i++) {
+        count = 0;
+        for (stats = bn_stats_all; stats != NULL; stats = stats->next) {
+            count += (long long)stats->events[i];
+        }
+        RedisModule_ReplyWithSimpleString(ctx, bn_event_names[i]);
+        RedisModule_ReplyWithLongLong(ctx, count);
+    }
+
+    pthread_mutex_unlock(&bn_stats_lock);
+
+    return REDISMODULE_OK;
+}
+
+/* Times every command into the calling thread's stats block. */
+#define BN_CMD_TIMED(name, ...)                                                \
+    static int bn_timed_##name(RedisModuleCtx *ctx, RedisModuleString **argv, \
+                               int argc) {                                     \
+        int rc;                                                                \
+        uint64_t start = bn_stats_begin();                                     \
+                                                                               \
+        rc = cmd_##name(ctx, argv, argc);                                      \
+        bn_stats_end(bn_cmd_##name, start);                                    \
+                                                                               \
+        return rc;                                                             \
     }
+BN_COMMANDS(BN_CMD_TIMED)
+#undef BN_CMD_TIMED
 
-    if (incr) {
-        mpd_add(dec, dec, delta, &mpd_ctx);
-    } else {
-        mpd_sub(dec, dec, delta, &mpd_ctx);
+static const struct {
+    const char *name;
+    RedisModuleCmdFunc func;
+    const char *flags;
+    int firstkey, lastkey, keystep;
+} bn_commands[] = {
+#define BN_CMD_ENTRY(name, cmd, flags, first, last, step)                      \
+    {cmd, bn_timed_##name, flags, first, last, step},
+    BN_COMMANDS(BN_CMD_ENTRY)
+#undef BN_CMD_ENTRY
+};
+
+static void *bn_type_rdb_load(RedisModuleIO *rdb, int encver) {
+    uint32_t status = 0;
+    uint64_t flags;
+    int64_t exp;
+    uint64_t len, i;
+    bn_value_t *v;
+
+    if (encver != BN_TYPE_ENCVER) {
+        RedisModule_LogIOError(rdb, "warning",
+                               "Unsupported bignumber encoding version %d",
+                               encver);
+        return NULL;
     }
 
-    len = mpd_to_sci_size(&str, dec, 0);
-    dest = RedisModule_CreateString(ctx, str, len);
+    flags = RedisModule_LoadUnsigned(rdb);
+    exp = RedisModule_LoadSigned(rdb);
+    len = RedisModule_LoadUnsigned(rdb);
 
-    free(str);
-    mpd_del(dec);
+    v = bn_value_new();
+    if (len == 0 || !mpd_qresize(&v->dec, (mpd_ssize_t)len, &status)) {
+        bn_value_free(v);
+        return NULL;
+    }
 
-    reply = hash ? RedisModule_Call(ctx, "HSET", "sss!", hash, key, dest)
-                 : RedisModule_Call(ctx, "SET", "ss!", key, dest);
-    if (RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ERROR) {
-        RedisModule_ReplyWithCallReply(ctx, reply);
-        return REDISMODULE_ERR;
+    for (i = 0; i < len; i++) {
+        v->dec.data[i] = RedisModule_LoadUnsigned(rdb);
+        if (v->dec.data[i] >= MPD_RADIX) {
+            RedisModule_LogIOError(rdb, "warning",
+                                   "Invalid bignumber coefficient word");
+            bn_value_free(v);
+            return NULL;
+        }
     }
 
-    return RedisModule_ReplyWithString(ctx, dest);
+    v->dec.flags = (v->dec.flags & ~(MPD_NEG | MPD_SPECIAL)) |
+                   (uint8_t)(flags & (MPD_NEG | MPD_SPECIAL));
+    v->dec.exp = exp;
+    v->dec.len = (mpd_ssize_t)len;
+    mpd_setdigits(&v->dec);
+
+    return v;
 }
 
-static inline int bn_incrby_helper(RedisModuleCtx *ctx,
-                                   RedisModuleString **argv, int argc,
-                                   int incr) {
-    int rc;
-    const char *val;
-    mpd_t *dec;
-    RedisModuleString *delta;
+/* The coefficient is saved as base 10**MPD_RDIGITS words, most significant
+ * last, the same layout libmpdec keeps in memory. */
+static void bn_type_rdb_save(RedisModuleIO *rdb, void *value) {
+    mpd_ssize_t i;
+    bn_value_t *v = value;
 
-    if (argc != 3) {
-        return RedisModule_WrongArity(ctx);
+    RedisModule_SaveUnsigned(rdb, v->dec.flags & (MPD_NEG | MPD_SPECIAL));
+    RedisModule_SaveSigned(rdb, v->dec.exp);
+    RedisModule_SaveUnsigned(rdb, (uint64_t)v->dec.len);
+    for (i = 0; i < v->dec.len; i++) {
+        RedisModule_SaveUnsigned(rdb, v->dec.data[i]);
     }
+}
 
-    delta = argv[2];
-    val = RedisModule_StringPtrLen(delta, NULL);
+static void bn_type_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                void *value) {
+    size_t len;
+    char *str;
+    bn_value_t *v = value;
 
-    dec = decimal(val, 0);
-    if (dec == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    len = bn_format(&v->dec, &str);
+    RedisModule_EmitAOF(aof, "BN.SET", "sb", key, str, len);
+}
+
+static size_t bn_type_mem_usage(const void *value) {
+    const bn_value_t *v = value;
+    size_t size = sizeof(*v);
+
+    if (!mpd_isstatic_data(&v->dec)) {
+        size += (size_t)v->dec.alloc * sizeof(mpd_uint_t);
     }
 
-    rc = bn_incr_helper(ctx, NULL, argv[1], dec, incr);
+    return size;
+}
 
-    mpd_del(dec);
+static void bn_type_digest(RedisModuleDigest *md, void *value) {
+    size_t len;
+    char *str;
+    bn_value_t *v = value;
 
-    return rc;
+    len = bn_format(&v->dec, &str);
+    RedisModule_DigestAddStringBuffer(md, (unsigned char *)str, len);
+    RedisModule_DigestEndSequence(md);
 }
 
-static inline int bn_hincrby_helper(RedisModuleCtx *ctx,
-                                    RedisModuleString **argv, int argc,
-                                    int incr) {
-    int rc;
-    const char *val;
-    mpd_t *dec;
-    RedisModuleString *delta;
+/* Checks that a sort key and exponent loaded from an RDB are what
+ * bn_zkey_encode() makes of a decimal within BN_PREC_MAX digits, so that
+ * bn_zkey_decode() can trust them and equal scores still have equal keys. */
+static int bn_zkey_valid(const unsigned char *key, size_t len,
+                         mpd_ssize_t exp) {
+    int neg;
+    size_t i, end;
+    unsigned int hi, lo = 0;
+    uint64_t adj = 0;
+    int64_t adjexp, n = 0;
+    unsigned char b;
 
-    if (argc != 4) {
-        return RedisModule_WrongArity(ctx);
+    if (len == 0) {
+        return 0;
+    }
+    switch (key[0]) {
+    case BN_ZKEY_NEG_INF:
+    case BN_ZKEY_ZERO:
+    case BN_ZKEY_POS_INF:
+        return len == 1;
+    case BN_ZKEY_NEG:
+    case BN_ZKEY_POS:
+        break;
+    default:
+        return 0;
     }
 
-    delta = argv[3];
-    val = RedisModule_StringPtrLen(delta, NULL);
-
-    dec = decimal(val, 0);
-    if (dec == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    neg = key[0] == BN_ZKEY_NEG;
+    if (len < 10 + (size_t)neg || (neg && key[len - 1] != 0xff)) {
+        return 0;
     }
+    end = len - (size_t)neg;
 
-    rc = bn_incr_helper(ctx, argv[1], argv[2], dec, incr);
+    for (i = 1; i < 9; i++) {
+        adj = adj << 8 | (unsigned char)(neg ? ~key[i] : key[i]);
+    }
+    adjexp = (int64_t)(adj ^ ((uint64_t)1 << 63));
 
-    mpd_del(dec);
+    /* Digits are 1 to 10, only the low nibble of the last byte may be the
+     * zero padding, the leading digit isn't 0 and trailing zeros are
+     * stripped. */
+    for (i = 9; i < end; i++) {
+        b = (unsigned char)(neg ? ~key[i] : key[i]);
+        hi = b >> 4;
+        lo = b & 0xf;
+        if (hi == 0 || hi > 10 || lo > 10 || (lo == 0 && i + 1 < end)) {
+            return 0;
+        }
+        n += 1 + (lo != 0);
+    }
+    b = (unsigned char)(neg ? ~key[9] : key[9]);
+    if ((b >> 4) == 1 || (lo != 0 ? lo : hi) == 1) {
+        return 0;
+    }
 
-    return rc;
+    return adjexp <= MPD_MAX_EMAX && exp >= MPD_MIN_EMIN && exp <= adjexp &&
+           adjexp - exp + 1 >= n && adjexp - exp < BN_PREC_MAX;
 }
 
-int cmd_ADD(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_op_helper(ctx, argv, argc, op_add);
-}
+/* Sorted sets are saved in order as (sort key, exponent, member) triples,
+ * see bn_zkey_encode(). */
+static void *bn_zset_rdb_load(RedisModuleIO *rdb, int encver) {
+    uint64_t i, n;
+    size_t mlen;
+    char *member;
+    bn_zkey_t key;
+    bn_zset_t *zs;
 
-int cmd_SUB(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_op_helper(ctx, argv, argc, op_sub);
-}
+    if (encver != BN_ZSET_ENCVER) {
+        RedisModule_LogIOError(rdb, "warning",
+                               "Unsupported bn-sorted encoding version %d",
+                               encver);
+        return NULL;
+    }
 
-int cmd_MUL(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_op_helper(ctx, argv, argc, op_mul);
-}
+    zs = bn_zset_new();
+    n = RedisModule_LoadUnsigned(rdb);
+    for (i = 0; i < n; i++) {
+        key.buf = (unsigned char *)RedisModule_LoadStringBuffer(rdb, &key.len);
+        key.exp = (mpd_ssize_t)RedisModule_LoadSigned(rdb);
+        member = RedisModule_LoadStringBuffer(rdb, &mlen);
 
-int cmd_DIV(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_op_helper(ctx, argv, argc, op_div);
-}
+        if (!bn_zkey_valid(key.buf, key.len, key.exp)) {
+            RedisModule_LogIOError(rdb, "warning", "Invalid bn-sorted score");
+            RedisModule_Free(key.buf);
+            RedisModule_Free(member);
+            bn_zset_free(zs);
+            return NULL;
+        }
 
-int cmd_ABS(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+        bn_zset_set(zs, &key, member, mlen);
+        RedisModule_Free(key.buf);
+        RedisModule_Free(member);
+    }
 
-    size_t len;
-    char *str;
-    const char *val;
-    mpd_t *dec;
-    RedisModuleString *dest;
+    return zs;
+}
 
-    if (argc != 2) {
-        return RedisModule_WrongArity(ctx);
-    }
+static void bn_zset_rdb_save(RedisModuleIO *rdb, void *value) {
+    bn_zset_t *zs = value;
+    bn_znode_t *x;
 
-    val = RedisModule_StringPtrLen(argv[1], NULL);
-    dec = decimal(val, 0);
-    if (dec == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    RedisModule_SaveUnsigned(rdb, zs->length);
+    for (x = zs->header->level[0].forward; x != NULL;
+         x = x->level[0].forward) {
+        RedisModule_SaveStringBuffer(rdb, (const char *)x->key, x->klen);
+        RedisModule_SaveSigned(rdb, x->exp);
+        RedisModule_SaveStringBuffer(rdb, x->member, x->mlen);
     }
+}
 
-    mpd_abs(dec, dec, &mpd_ctx);
+static void bn_zset_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                void *value) {
+    size_t len, mark;
+    char *str;
+    mpd_t *dec;
+    bn_zset_t *zs = value;
+    bn_znode_t *x;
 
-    len = mpd_to_sci_size(&str, dec, 0);
-    dest = RedisModule_CreateString(ctx, str, len);
+    mark = bn_scratch_mark();
+    for (x = zs->header->level[0].forward; x != NULL;
+         x = x->level[0].forward) {
+        dec = bn_scratch_new();
+        bn_zkey_decode(x->key, x->klen, x->exp, dec);
+        len = bn_format(dec, &str);
+        RedisModule_EmitAOF(aof, "BN.ZADD", "sbb", key, str, len, x->member,
+                            (size_t)x->mlen);
+        bn_scratch_release(mark);
+    }
+}
 
-    free(str);
-    mpd_del(dec);
+static size_t bn_zset_mem_usage(const void *value) {
+    const bn_zset_t *zs = value;
 
-    return RedisModule_ReplyWithString(ctx, dest);
+    /* Plus a few words per member for the dict. */
+    return zs->bytes + zs->length * sizeof(void *) * 4;
 }
 
-int cmd_TO_FIXED(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-
-    size_t len;
+static void bn_zset_digest(RedisModuleDigest *md, void *value) {
+    size_t len, mark;
     char *str;
-    long long digits;
-    const char *val;
     mpd_t *dec;
-    RedisModuleString *dest;
+    bn_zset_t *zs = value;
+    bn_znode_t *x;
 
-    if (argc != 3) {
-        return RedisModule_WrongArity(ctx);
+    mark = bn_scratch_mark();
+    for (x = zs->header->level[0].forward; x != NULL;
+         x = x->level[0].forward) {
+        dec = bn_scratch_new();
+        bn_zkey_decode(x->key, x->klen, x->exp, dec);
+        len = bn_format(dec, &str);
+        RedisModule_DigestAddStringBuffer(md, (unsigned char *)x->member,
+                                          x->mlen);
+        RedisModule_DigestAddStringBuffer(md, (unsigned char *)str, len);
+        RedisModule_DigestEndSequence(md);
+        bn_scratch_release(mark);
     }
+}
 
-    if (RedisModule_StringToLongLong(argv[2], &digits) != REDISMODULE_OK) {
-        return RedisModule_ReplyWithError(ctx, "ERR invalid digits parameter");
+/* Ledgers are saved as (timestamp, id, sign, exponent, coefficient words)
+ * entries, oldest first, the balance and checkpoints are rebuilt on load. */
+static void *bn_ledger_rdb_load(RedisModuleIO *rdb, int encver) {
+    uint64_t i, j, n, len;
+    int64_t ts, id;
+    mpd_uint_t *words = NULL;
+    mpd_t dec;
+    bn_ledger_t *lg;
+
+    if (encver != BN_LEDGER_ENCVER) {
+        RedisModule_LogIOError(rdb, "warning",
+                               "Unsupported bn-ledger encoding version %d",
+                               encver);
+        return NULL;
     }
 
-    val = RedisModule_StringPtrLen(argv[1], NULL);
-    dec = decimal(val, 0);
-    if (dec == NULL) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    lg = bn_ledger_new();
+    n = RedisModule_LoadUnsigned(rdb);
+    for (i = 0; i < n; i++) {
+        ts = RedisModule_LoadSigned(rdb);
+        id = RedisModule_LoadSigned(rdb);
+        dec.flags = (uint8_t)(RedisModule_LoadUnsigned(rdb) & MPD_NEG);
+        dec.exp = (mpd_ssize_t)RedisModule_LoadSigned(rdb);
+        len = RedisModule_LoadUnsigned(rdb);
+        if (len == 0 || len > UINT32_MAX || ts < bn_ledger_last_ts(lg)) {
+            goto invalid;
+        }
+
+        words = RedisModule_Realloc(words, len * sizeof(*words));
+        for (j = 0; j < len; j++) {
+            words[j] = RedisModule_LoadUnsigned(rdb);
+            if (words[j] >= MPD_RADIX) {
+                goto invalid;
+            }
+        }
+
+        dec.flags |= MPD_STATIC | MPD_CONST_DATA;
+        dec.len = dec.alloc = (mpd_ssize_t)len;
+        dec.data = words;
+        mpd_setdigits(&dec);
+        bn_ledger_append(lg, ts, id, &dec);
     }
 
-    mpd_rescale(dec, dec, -(int)digits, &mpd_ctx);
+    RedisModule_Free(words);
 
-    len = mpd_to_sci_size(&str, dec, 0);
-    dest = RedisModule_CreateString(ctx, str, len);
+    return lg;
 
-    free(str);
-    mpd_del(dec);
+invalid:
+    RedisModule_LogIOError(rdb, "warning", "Invalid bn-ledger entry");
+    RedisModule_Free(words);
+    bn_ledger_free(lg);
 
-    return RedisModule_ReplyWithString(ctx, dest);
+    return NULL;
 }
 
-int cmd_GET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-
-    long long digits;
+static void bn_ledger_rdb_save(RedisModuleIO *rdb, void *value) {
+    size_t k;
+    uint32_t i, j;
+    bn_ledger_t *lg = value;
+    const bn_lrec_t *r;
 
-    if (argc < 2 || argc > 3) {
-        return RedisModule_WrongArity(ctx);
+    RedisModule_SaveUnsigned(rdb, lg->length);
+    for (k = 0; k < lg->nchunks; k++) {
+        r = (const bn_lrec_t *)lg->chunks[k].buf;
+        for (i = 0; i < lg->chunks[k].n; i++, r = bn_lrec_next(r)) {
+            RedisModule_SaveSigned(rdb, r->ts);
+            RedisModule_SaveSigned(rdb, r->id);
+            RedisModule_SaveUnsigned(rdb, r->sign);
+            RedisModule_SaveSigned(rdb, r->exp);
+            RedisModule_SaveUnsigned(rdb, r->len);
+            for (j = 0; j < r->len; j++) {
+                RedisModule_SaveUnsigned(rdb, ((const mpd_uint_t *)(r + 1))[j]);
+            }
+        }
     }
+}
 
-    digits = 0;
-    if (argc == 3) {
-        if (RedisModule_StringToLongLong(argv[2], &digits) != REDISMODULE_OK) {
-            return RedisModule_ReplyWithError(ctx,
-                                              "ERR invalid digits parameter");
+static void bn_ledger_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                  void *value) {
+    size_t k, len;
+    uint32_t i;
+    char *str;
+    mpd_t view;
+    bn_ledger_t *lg = value;
+    const bn_lrec_t *r;
+
+    for (k = 0; k < lg->nchunks; k++) {
+        r = (const bn_lrec_t *)lg->chunks[k].buf;
+        for (i = 0; i < lg->chunks[k].n; i++, r = bn_lrec_next(r)) {
+            bn_lrec_view(r, &view);
+            len = bn_format(&view, &str);
+            RedisModule_EmitAOF(aof, "BN.LEDGER.APPEND", "sbclcl", key, str,
+                                len, "TS", (long long)r->ts, "ID",
+                                (long long)r->id);
         }
     }
+}
 
-    return bn_get_helper(ctx, NULL, argv[1], (int)digits);
+static size_t bn_ledger_mem_usage(const void *value) {
+    const bn_ledger_t *lg = value;
+
+    return lg->bytes;
 }
 
-int cmd_INCR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+static void bn_ledger_digest(RedisModuleDigest *md, void *value) {
+    size_t k, len;
+    uint32_t i;
+    char *str;
+    mpd_t view;
+    bn_ledger_t *lg = value;
+    const bn_lrec_t *r;
 
-    if (argc != 2) {
-        return RedisModule_WrongArity(ctx);
+    for (k = 0; k < lg->nchunks; k++) {
+        r = (const bn_lrec_t *)lg->chunks[k].buf;
+        for (i = 0; i < lg->chunks[k].n; i++, r = bn_lrec_next(r)) {
+            bn_lrec_view(r, &view);
+            len = bn_format(&view, &str);
+            RedisModule_DigestAddLongLong(md, r->ts);
+            RedisModule_DigestAddLongLong(md, r->id);
+            RedisModule_DigestAddStringBuffer(md, (unsigned char *)str, len);
+            RedisModule_DigestEndSequence(md);
+        }
     }
+}
 
-    return bn_incr_helper(ctx, NULL, argv[1], mpd_one, 1);
+/* Series are saved as their bucket width, slot count and newest bucket,
+ * then the retained buckets oldest first, each as its number, count and sum,
+ * min and max decimals. */
+static void bn_series_save_dec(RedisModuleIO *rdb, const bn_sval_t *v) {
+    uint32_t i;
+
+    RedisModule_SaveUnsigned(rdb, v->sign);
+    RedisModule_SaveSigned(rdb, v->exp);
+    RedisModule_SaveUnsigned(rdb, v->len);
+    for (i = 0; i < v->len; i++) {
+        RedisModule_SaveUnsigned(rdb, ((const mpd_uint_t *)(v + 1))[i]);
+    }
 }
 
-int cmd_DECR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+static int bn_series_load_dec(RedisModuleIO *rdb, mpd_t *dec) {
+    uint32_t status = 0;
+    uint64_t i, sign, len;
+    int64_t exp;
 
-    if (argc != 2) {
-        return RedisModule_WrongArity(ctx);
+    sign = RedisModule_LoadUnsigned(rdb);
+    exp = RedisModule_LoadSigned(rdb);
+    len = RedisModule_LoadUnsigned(rdb);
+    if (len == 0 || len > UINT32_MAX ||
+        !mpd_qresize(dec, (mpd_ssize_t)len, &status)) {
+        return REDISMODULE_ERR;
     }
 
-    return bn_incr_helper(ctx, NULL, argv[1], mpd_one, 0);
-}
+    for (i = 0; i < len; i++) {
+        dec->data[i] = RedisModule_LoadUnsigned(rdb);
+        if (dec->data[i] >= MPD_RADIX) {
+            return REDISMODULE_ERR;
+        }
+    }
 
-int cmd_INCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_incrby_helper(ctx, argv, argc, 1);
-}
+    mpd_set_sign(dec, (uint8_t)(sign & MPD_NEG));
+    dec->exp = exp;
+    dec->len = (mpd_ssize_t)len;
+    mpd_setdigits(dec);
 
-int cmd_DECRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_incrby_helper(ctx, argv, argc, 0);
+    return REDISMODULE_OK;
 }
 
-int cmd_HGET(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+static void *bn_series_rdb_load(RedisModuleIO *rdb, int encver) {
+    int j;
+    uint64_t i, n, nslots;
+    int64_t width, last, b, count;
+    size_t mark;
+    mpd_t *dec[3];
+    bn_series_t *s;
 
-    long long digits;
+    if (encver != BN_SERIES_ENCVER) {
+        RedisModule_LogIOError(rdb, "warning",
+                               "Unsupported bn-series encoding version %d",
+                               encver);
+        return NULL;
+    }
 
-    if (argc < 3 || argc > 4) {
-        return RedisModule_WrongArity(ctx);
+    width = RedisModule_LoadSigned(rdb);
+    nslots = RedisModule_LoadUnsigned(rdb);
+    last = RedisModule_LoadSigned(rdb);
+    if (width < 1 || nslots < 1 || nslots > BN_SERIES_MAX_SLOTS) {
+        RedisModule_LogIOError(rdb, "warning", "Invalid bn-series header");
+        return NULL;
     }
 
-    digits = 0;
-    if (argc == 4) {
-        if (RedisModule_StringToLongLong(argv[3], &digits) != REDISMODULE_OK) {
-            return RedisModule_ReplyWithError(ctx,
-                                              "ERR invalid digits parameter");
+    s = bn_series_new(width, (uint32_t)nslots);
+    s->last = last;
+    n = RedisModule_LoadUnsigned(rdb);
+    for (i = 0; i < n; i++) {
+        b = RedisModule_LoadSigned(rdb);
+        count = RedisModule_LoadSigned(rdb);
+        mark = bn_scratch_mark();
+        for (j = 0; j < 3; j++) {
+            dec[j] = bn_scratch_new();
+            if (bn_series_load_dec(rdb, dec[j]) != REDISMODULE_OK) {
+                break;
+            }
+        }
+        if (j < 3 || b < bn_series_first(s) || b > last || count < 1) {
+            RedisModule_LogIOError(rdb, "warning", "Invalid bn-series bucket");
+            bn_scratch_release(mark);
+            bn_series_free(s);
+            return NULL;
         }
+        bn_series_merge(s, b, count, dec[BN_SLOT_SUM], dec[BN_SLOT_MIN],
+                        dec[BN_SLOT_MAX]);
+        bn_scratch_release(mark);
     }
 
-    return bn_get_helper(ctx, argv[1], argv[2], (int)digits);
+    return s;
 }
 
-int cmd_HINCR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+static void bn_series_rdb_save(RedisModuleIO *rdb, void *value) {
+    int j;
+    uint64_t n = 0;
+    int64_t b;
+    bn_series_t *s = value;
+    bn_slot_t *slot;
 
-    if (argc != 3) {
-        return RedisModule_WrongArity(ctx);
+    RedisModule_SaveSigned(rdb, s->width);
+    RedisModule_SaveUnsigned(rdb, s->nslots);
+    RedisModule_SaveSigned(rdb, s->last);
+
+    for (b = bn_series_first(s); b <= s->last; b++) {
+        n += bn_series_slot(s, b)->bucket == b;
     }
+    RedisModule_SaveUnsigned(rdb, n);
 
-    return bn_incr_helper(ctx, argv[1], argv[2], mpd_one, 1);
+    for (b = bn_series_first(s); b <= s->last; b++) {
+        slot = bn_series_slot(s, b);
+        if (slot->bucket != b) {
+            continue;
+        }
+        RedisModule_SaveSigned(rdb, b);
+        RedisModule_SaveSigned(rdb, slot->count);
+        for (j = 0; j < 3; j++) {
+            bn_series_save_dec(rdb, bn_slot_val(s, slot, j));
+        }
+    }
 }
 
-int cmd_HDECR(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+static void bn_series_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                  void *value) {
+    int j;
+    int64_t b;
+    size_t len[3];
+    char *buf[3];
+    mpd_t dec[3];
+    bn_series_t *s = value;
+    bn_slot_t *slot;
 
-    if (argc != 3) {
-        return RedisModule_WrongArity(ctx);
+    for (b = bn_series_first(s); b <= s->last; b++) {
+        slot = bn_series_slot(s, b);
+        if (slot->bucket != b) {
+            continue;
+        }
+        for (j = 0; j < 3; j++) {
+            bn_sval_view(bn_slot_val(s, slot, j), &dec[j]);
+            buf[j] = RedisModule_Alloc(BN_FORMAT_SIZE(&dec[j]));
+            len[j] = bn_format_to(&dec[j], buf[j]);
+        }
+        RedisModule_EmitAOF(aof, "BN.TS.MERGE", "sllbbbclcl", key,
+                            (long long)(b * s->width), (long long)slot->count,
+                            buf[BN_SLOT_SUM], len[BN_SLOT_SUM],
+                            buf[BN_SLOT_MIN], len[BN_SLOT_MIN],
+                            buf[BN_SLOT_MAX], len[BN_SLOT_MAX], "BUCKET",
+                            (long long)s->width, "RETENTION",
+                            (long long)(s->width * s->nslots));
+        for (j = 0; j < 3; j++) {
+            RedisModule_Free(buf[j]);
+        }
     }
-
-    return bn_incr_helper(ctx, argv[1], argv[2], mpd_one, 0);
 }
 
-int cmd_HINCRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_hincrby_helper(ctx, argv, argc, 1);
+static size_t bn_series_mem_usage(const void *value) {
+    const bn_series_t *s = value;
+
+    return sizeof(*s) + s->nslots * s->slotsize;
 }
 
-int cmd_HDECRBY(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-    return bn_hincrby_helper(ctx, argv, argc, 0);
+static void bn_series_digest(RedisModuleDigest *md, void *value) {
+    int j;
+    int64_t b;
+    size_t len;
+    char *str;
+    mpd_t dec;
+    bn_series_t *s = value;
+    bn_slot_t *slot;
+
+    for (b = bn_series_first(s); b <= s->last; b++) {
+        slot = bn_series_slot(s, b);
+        if (slot->bucket != b) {
+            continue;
+        }
+        RedisModule_DigestAddLongLong(md, b * s->width);
+        RedisModule_DigestAddLongLong(md, slot->count);
+        for (j = 0; j < 3; j++) {
+            bn_sval_view(bn_slot_val(s, slot, j), &dec);
+            len = bn_format(&dec, &str);
+            RedisModule_DigestAddStringBuffer(md, (unsigned char *)str, len);
+        }
+        RedisModule_DigestEndSequence(md);
+    }
 }
 
 static inline void initMPD() {
@@ -443,104 +7134,215 @@ static inline void initMPD() {
 
     mpd_one = mpd_new(&mpd_ctx);
     mpd_set_string(mpd_one, "1", &mpd_ctx);
+
+#ifdef BN_HAVE_INT128
+    bn_fixed_init();
+#endif
+
+    bn_config_update();
 }
 
-int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
-                       int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
+/* Module arguments are parameter/value pairs, see bn_config_set(). */
+static int bn_config_load(RedisModuleCtx *ctx, RedisModuleString **argv,
+                          int argc) {
+    int i;
+    const char *name, *err;
 
-    if (RedisModule_Init(ctx, "bn", 1, REDISMODULE_APIVER_1) ==
-        REDISMODULE_ERR) {
+    if (argc % 2 != 0) {
+        RedisModule_Log(ctx, "warning",
+                        "module arguments must be parameter/value pairs");
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.add", cmd_ADD, "readonly fast", 0,
-                                  0, 0) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
+    for (i = 0; i < argc; i += 2) {
+        name = RedisModule_StringPtrLen(argv[i], NULL);
+        if (bn_config_set(name, argv[i + 1], &err) != REDISMODULE_OK) {
+            RedisModule_Log(ctx, "warning", "%s: %s %s", err, name,
+                            RedisModule_StringPtrLen(argv[i + 1], NULL));
+            return REDISMODULE_ERR;
+        }
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.sub", cmd_SUB, "readonly fast", 0,
-                                  0, 0) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
-    }
+    return REDISMODULE_OK;
+}
 
-    if (RedisModule_CreateCommand(ctx, "bn.mul", cmd_MUL, "readonly fast", 0,
-                                  0, 0) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
-    }
+/* The shared API, see bignumber_api.h. The functions borrow scratch
+ * decimals and give them back before returning, whoever the caller. */
+static mpd_t *bn_api_create(void) {
+    mpd_t *dec = mpd_qnew();
 
-    if (RedisModule_CreateCommand(ctx, "bn.div", cmd_DIV, "readonly fast", 0,
-                                  0, 0) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
+    if (dec != NULL) {
+        mpd_zerocoeff(dec);
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.abs", cmd_ABS, "readonly fast", 0,
-                                  0, 0) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
-    }
+    return dec;
+}
 
-    if (RedisModule_CreateCommand(ctx, "bn.to_fixed", cmd_TO_FIXED,
-                                  "readonly fast", 0, 0,
-                                  0) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
+static void bn_api_destroy(mpd_t *dec) { mpd_del(dec); }
+
+static int bn_api_parse(mpd_t *dec, const char *s, size_t len) {
+    uint32_t status = 0;
+    size_t mark = bn_scratch_mark();
+    mpd_t *res = decimal(s, len, 0);
+
+    if (res != NULL) {
+        mpd_qcopy(dec, res, &status);
     }
+    bn_scratch_release(mark);
+
+    return res != NULL ? REDISMODULE_OK : REDISMODULE_ERR;
+}
 
-    if (RedisModule_CreateCommand(ctx, "bn.get", cmd_GET, "readonly", 1, 1,
-                                  1) == REDISMODULE_ERR) {
+/* BN_API_ADD and friends are the bn_op_t values. */
+static int bn_api_apply(mpd_t *lhs, const mpd_t *rhs, int op) {
+    int rc;
+    size_t mark = bn_scratch_mark();
+
+    if (op < BN_API_ADD || op > BN_API_DIV) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.incr", cmd_INCR, "write deny-oom",
-                                  1, 1, 1) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
+    rc = bn_apply(lhs, rhs, (bn_op_t)op);
+    bn_scratch_release(mark);
+
+    return rc;
+}
+
+static void bn_api_rescale(mpd_t *res, const mpd_t *a, int digits) {
+    bn_rescale(res, a, -digits);
+}
+
+static size_t bn_api_format_size(const mpd_t *dec) {
+    return BN_FORMAT_SIZE(dec);
+}
+
+static int bn_api_incrby(RedisModuleCtx *ctx, RedisModuleString *hash,
+                         RedisModuleString *key, const mpd_t *delta,
+                         const mpd_t *min, const mpd_t *max, mpd_t *res) {
+    int rc;
+    uint32_t status = 0;
+    size_t mark = bn_scratch_mark();
+    mpd_t *cur;
+    bn_bounds_t bounds = {min, max};
+
+    rc = bn_incr_apply(ctx, hash, key, delta, 1,
+                       min != NULL || max != NULL ? &bounds : NULL, &cur);
+    if (rc != REDISMODULE_ERR && res != NULL) {
+        mpd_qcopy(res, cur, &status);
     }
+    bn_scratch_release(mark);
+
+    return rc;
+}
 
-    if (RedisModule_CreateCommand(ctx, "bn.decr", cmd_DECR, "write deny-oom",
-                                  1, 1, 1) == REDISMODULE_ERR) {
+static BigNumberAPI bn_api = {.version = BN_API_VERSION,
+                              .context = &mpd_ctx,
+                              .create = bn_api_create,
+                              .destroy = bn_api_destroy,
+                              .parse = bn_api_parse,
+                              .apply = bn_api_apply,
+                              .rescale = bn_api_rescale,
+                              .format_size = bn_api_format_size,
+                              .format = bn_format_to,
+                              .incrby = bn_api_incrby};
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
+                       int argc) {
+    size_t i;
+
+    if (RedisModule_Init(ctx, "bn", 1, REDISMODULE_APIVER_1) ==
+        REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.incrby", cmd_INCRBY,
-                                  "write deny-oom", 1, 1,
-                                  1) == REDISMODULE_ERR) {
+    RedisModuleTypeMethods tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                 .rdb_load = bn_type_rdb_load,
+                                 .rdb_save = bn_type_rdb_save,
+                                 .aof_rewrite = bn_type_aof_rewrite,
+                                 .mem_usage = bn_type_mem_usage,
+                                 .digest = bn_type_digest,
+                                 .free = bn_value_free};
+
+    bn_type = RedisModule_CreateDataType(ctx, BN_TYPE_NAME, BN_TYPE_ENCVER,
+                                         &tm);
+    if (bn_type == NULL) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.decrby", cmd_DECRBY,
-                                  "write deny-oom", 1, 1,
-                                  1) == REDISMODULE_ERR) {
+    RedisModuleTypeMethods ztm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                  .rdb_load = bn_zset_rdb_load,
+                                  .rdb_save = bn_zset_rdb_save,
+                                  .aof_rewrite = bn_zset_aof_rewrite,
+                                  .mem_usage = bn_zset_mem_usage,
+                                  .digest = bn_zset_digest,
+                                  .free = bn_zset_free};
+
+    bn_zset_type = RedisModule_CreateDataType(ctx, BN_ZSET_TYPE_NAME,
+                                              BN_ZSET_ENCVER, &ztm);
+    if (bn_zset_type == NULL) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.hget", cmd_HGET, "readonly", 1, 1,
-                                  1) == REDISMODULE_ERR) {
+    RedisModuleTypeMethods ltm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                  .rdb_load = bn_ledger_rdb_load,
+                                  .rdb_save = bn_ledger_rdb_save,
+                                  .aof_rewrite = bn_ledger_aof_rewrite,
+                                  .mem_usage = bn_ledger_mem_usage,
+                                  .digest = bn_ledger_digest,
+                                  .free = bn_ledger_free};
+
+    bn_ledger_type = RedisModule_CreateDataType(ctx, BN_LEDGER_TYPE_NAME,
+                                                BN_LEDGER_ENCVER, &ltm);
+    if (bn_ledger_type == NULL) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.hincr", cmd_HINCR, "write deny-oom",
-                                  1, 1, 1) == REDISMODULE_ERR) {
+    RedisModuleTypeMethods stm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                  .rdb_load = bn_series_rdb_load,
+                                  .rdb_save = bn_series_rdb_save,
+                                  .aof_rewrite = bn_series_aof_rewrite,
+                                  .mem_usage = bn_series_mem_usage,
+                                  .digest = bn_series_digest,
+                                  .free = bn_series_free};
+
+    bn_series_type = RedisModule_CreateDataType(ctx, BN_SERIES_TYPE_NAME,
+                                                BN_SERIES_ENCVER, &stm);
+    if (bn_series_type == NULL) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.hdecr", cmd_HDECR, "write deny-oom",
-                                  1, 1, 1) == REDISMODULE_ERR) {
-        return REDISMODULE_ERR;
+    for (i = 0; i < sizeof(bn_commands) / sizeof(bn_commands[0]); i++) {
+        if (RedisModule_CreateCommand(ctx, bn_commands[i].name,
+                                      bn_commands[i].func, bn_commands[i].flags,
+                                      bn_commands[i].firstkey,
+                                      bn_commands[i].lastkey,
+                                      bn_commands[i].keystep) ==
+            REDISMODULE_ERR) {
+            return REDISMODULE_ERR;
+        }
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.hincrby", cmd_HINCRBY,
-                                  "write deny-oom", 1, 1,
-                                  1) == REDISMODULE_ERR) {
+    initMPD();
+
+    if (bn_config_load(ctx, argv, argc) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "bn.hdecrby", cmd_HDECRBY,
-                                  "write deny-oom", 1, 1,
-                                  1) == REDISMODULE_ERR) {
+    if (RedisModule_SubscribeToKeyspaceEvents(
+            ctx,
+            REDISMODULE_NOTIFY_GENERIC | REDISMODULE_NOTIFY_STRING |
+                REDISMODULE_NOTIFY_EXPIRED | REDISMODULE_NOTIFY_EVICTED,
+            bn_wait_notify) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    initMPD();
+    /* Servers without the shared API just don't get it. */
+    if (RedisModule_ExportSharedAPI == NULL ||
+        RedisModule_ExportSharedAPI(ctx, BN_API_NAME, &bn_api) ==
+            REDISMODULE_ERR) {
+        RedisModule_Log(ctx, "notice", "shared API %s not exported",
+                        BN_API_NAME);
+    }
 
     return REDISMODULE_OK;
 }
@@ -0,0 +1,82 @@
+/*
+ * The C API the bignumber module exports to other modules loaded in the same
+ * server, so that they can use its decimal kernels with a function call
+ * instead of a RedisModule_Call() round trip. It is only available once the
+ * bignumber module is loaded, typically look it up on the first command
+ * rather than in RedisModule_OnLoad():
+ *
+ *   const BigNumberAPI *bn = RedisModule_GetSharedAPI(ctx, BN_API_NAME);
+ *
+ *   if (bn == NULL || bn->version < BN_API_VERSION) {
+ *       return RedisModule_ReplyWithError(ctx, "ERR bignumber not loaded");
+ *   }
+ *
+ * Decimals are libmpdec ones, create them with create() and free them with
+ * destroy(). All the kernels round with the context of the bignumber module, as
+ * set with BN.CONFIG, and produce exactly what the matching bn.* command
+ * would. The arithmetic functions may be called from any thread, the ones
+ * taking a RedisModuleCtx need the server lock like any keyspace access.
+ *
+ * Fields are only ever appended to BigNumberAPI, each addition bumps
+ * BN_API_VERSION.
+ */
+
+#ifndef BIGNUMBER_API_H
+#define BIGNUMBER_API_H
+
+#include <stddef.h>
+
+#include <mpdecimal.h>
+
+#include "redismodule.h"
+
+#define BN_API_NAME "bn.api"
+#define BN_API_VERSION 1
+
+/* The op of apply(). */
+#define BN_API_ADD 0
+#define BN_API_SUB 1
+#define BN_API_MUL 2
+#define BN_API_DIV 3
+
+/* Returned by incrby() when the result would leave [min, max]. */
+#define BN_API_ERR_BOUNDS 2
+
+typedef struct {
+    int version;
+
+    /* The context the kernels round with. */
+    const mpd_context_t *context;
+
+    /* A new decimal set to zero, or NULL if out of memory. */
+    mpd_t *(*create)(void);
+    void (*destroy)(mpd_t *dec);
+
+    /* Parses the len bytes at s, like the arguments of the bn.* commands.
+     * Returns REDISMODULE_ERR for a malformed number. */
+    int (*parse)(mpd_t *dec, const char *s, size_t len);
+
+    /* lhs = lhs op rhs, fails only on division by zero. */
+    int (*apply)(mpd_t *lhs, const mpd_t *rhs, int op);
+
+    /* res = a rounded to digits after the decimal point, see bn.to_fixed. */
+    void (*rescale)(mpd_t *res, const mpd_t *a, int digits);
+
+    /* format() writes the string form of dec to buf, which must have room
+     * for format_size(dec) bytes, and returns its length. No NUL is
+     * written. */
+    size_t (*format_size)(const mpd_t *dec);
+    size_t (*format)(const mpd_t *dec, char *buf);
+
+    /* Adds delta to the value at key, or at a field of the hash when hash
+     * isn't NULL, like bn.incrby and bn.hincrby with optional MIN and MAX
+     * bounds (NULL for none). res, if not NULL, is set to the new value, or
+     * to the current one on BN_API_ERR_BOUNDS. Returns REDISMODULE_ERR if
+     * the key holds the wrong kind of value. ctx must have automatic memory
+     * management enabled, replication is up to the caller. */
+    int (*incrby)(RedisModuleCtx *ctx, RedisModuleString *hash,
+                  RedisModuleString *key, const mpd_t *delta, const mpd_t *min,
+                  const mpd_t *max, mpd_t *res);
+} BigNumberAPI;
+
+#endif
@@ -7,6 +7,7 @@ import (
 	"os"
 	"os/signal"
 	"strconv"
+	"strings"
 	"sync"
 	"sync/atomic"
 	"syscall"
@@ -27,6 +28,14 @@ var (
 	_fracKey   = "bn:frac"
 	_randomKey = "bn:random"
 	_hashKey   = "bn:hash"
+	_zsetKey   = "bn:zset"
+	_boundKey  = "bn:bounded"
+	_srcKey    = "bn:src"
+	_dstKey    = "bn:dst"
+	_ledgerKey = "bn:ledger"
+	_seriesKey = "bn:series"
+	_idemKey   = "bn:idempotent"
+	_highKey   = "bn:high"
 	_eps       = "0.000000000000000000000000000000001"
 	_delta     = "0.00000000000000000000000000000001"
 
@@ -50,6 +59,7 @@ var (
 	}
 
 	_apd1       = mustParseDecimal("1")
+	_apd10      = mustParseDecimal("10")
 	_apdEpsilon = mustParseDecimal(_eps)
 	_apdDelta   = mustParseDecimal(_delta)
 
@@ -60,6 +70,11 @@ var (
 	_apdHashRadix  = mustParseDecimal("0")
 	_apdHashFrac   = mustParseDecimal("0")
 	_apdHashRandom = mustParseDecimal("0")
+	_apdZsetRandom = mustParseDecimal("0")
+	_apdSrc        = mustParseDecimal("0")
+	_apdDst        = mustParseDecimal("0")
+	_apdLedger     = mustParseDecimal("0")
+	_apdIdem       = mustParseDecimal("0")
 )
 
 type Operation int
@@ -69,6 +84,10 @@ const (
 	OpSUB
 	OpMUL
 	OpDIV
+	OpSUM
+	OpPRODUCT
+	OpVADD
+	OpVMUL
 	OpABS
 	OpTO_FIXED
 	OpINCR
@@ -79,8 +98,20 @@ const (
 	OpHDECR
 	OpHINCRBY
 	OpHDECRBY
+	OpMINCRBY
+	OpHMINCRBY
 	OpRANDOM
 	OpHRANDOM
+	OpZINCRBY
+	OpBOUNDED
+	OpTRANSFER
+	OpEVAL
+	OpWAITUNTIL
+	OpLEDGER
+	OpTSADD
+	OpIDEMPOTENT
+	OpSETIFGT
+	OpMIGRATE
 )
 
 func mustParseDecimal(s string) *apd.Decimal {
@@ -121,6 +152,28 @@ func cmdDiv(client *redis.Client) {
 	doCmd(client, "bn.div", _delta, _delta)
 }
 
+func cmdSum(client *redis.Client) {
+	v := doCmd(client, "bn.sum", _delta, _delta, _delta, _delta)
+	if v != "4e-32" {
+		panic("sum")
+	}
+}
+
+func cmdProduct(client *redis.Client) {
+	doCmd(client, "bn.product", _delta, _delta, _delta)
+}
+
+func cmdVadd(client *redis.Client) {
+	v := doCmd(client, "bn.vadd", "1.5", _delta, "-1.5", _delta).([]interface{})
+	if len(v) != 2 || v[0] != "0.0" || v[1] != "2e-32" {
+		panic("vadd")
+	}
+}
+
+func cmdVmul(client *redis.Client) {
+	doCmd(client, "bn.vmul", _delta, _delta, _delta, _delta)
+}
+
 func cmdABS(client *redis.Client) {
 	d := "1234567890.0123456789"
 	v := doCmd(client, "bn.abs", "-"+d)
@@ -133,6 +186,13 @@ func cmdToFixed(client *redis.Client) {
 	doCmd(client, "bn.to_fixed", "0.123456789", 2)
 }
 
+func cmdEval(client *redis.Client) {
+	v := doCmd(client, "bn.eval", "(ARGV[1] + ARGV[2]) * ARGV[3] - ARGV[1]", 0, "1.5", _delta, "2")
+	if v != "1.50000000000000000000000000000002" {
+		panic("eval")
+	}
+}
+
 func cmdIncr(client *redis.Client) {
 	doCmd(client, "bn.incr", _radixKey)
 
@@ -237,6 +297,128 @@ func cmdHrandom(client *redis.Client) {
 	}
 }
 
+func cmdMincrby(client *redis.Client) {
+	doCmd(client, "bn.mincrby", _radixKey, "1", _fracKey, _delta)
+
+	_apdLock.Lock()
+	defer _apdLock.Unlock()
+	_apdCtx.Add(_apdRadix, _apdRadix, _apd1)
+	_apdCtx.Add(_apdFrac, _apdFrac, _apdDelta)
+}
+
+func cmdHmincrby(client *redis.Client) {
+	doCmd(client, "bn.hmincrby", _hashKey, _radixKey, "1", _fracKey, _delta)
+
+	_apdLock.Lock()
+	defer _apdLock.Unlock()
+	_apdCtx.Add(_apdHashRadix, _apdHashRadix, _apd1)
+	_apdCtx.Add(_apdHashFrac, _apdHashFrac, _apdDelta)
+}
+
+func cmdZincrby(client *redis.Client) {
+	v := randFloat()
+	doCmd(client, "bn.zincrby", _zsetKey, v, _randomKey)
+
+	d := mustParseDecimal(v)
+
+	_apdLock.Lock()
+	defer _apdLock.Unlock()
+	_apdCtx.Add(_apdZsetRandom, _apdZsetRandom, d)
+}
+
+func cmdBounded(client *redis.Client) {
+	delta := "1"
+	if rand.Intn(2) == 1 {
+		delta = "-1"
+	}
+
+	// However clients interleave, the value stays in [0, 10].
+	v, err := client.Do("bn.incrby", _boundKey, delta, "MIN", "0", "MAX", "10").Result()
+	if err != nil {
+		if !strings.HasPrefix(err.Error(), "BNBOUNDS ") {
+			panic(err)
+		}
+		return
+	}
+
+	d := mustParseDecimal(v.(string))
+	if d.Sign() < 0 || d.Cmp(_apd10) > 0 {
+		panic("bounded")
+	}
+}
+
+func cmdWaituntil(client *redis.Client) {
+	// cmdBounded keeps the value in [0, 10], the condition already holds.
+	v := doCmd(client, "bn.waituntil", _boundKey, "<=", "10", 1000)
+	d := mustParseDecimal(v.(string))
+	if d.Sign() < 0 || d.Cmp(_apd10) > 0 {
+		panic("waituntil")
+	}
+}
+
+func cmdLedger(client *redis.Client) {
+	doCmd(client, "bn.ledger.append", _ledgerKey, _delta)
+
+	_apdLock.Lock()
+	defer _apdLock.Unlock()
+	_apdCtx.Add(_apdLedger, _apdLedger, _apdDelta)
+}
+
+func cmdTsAdd(client *redis.Client) {
+	// Only _delta is ever added, no bucket sum can be smaller.
+	v := doCmd(client, "bn.ts.add", _seriesKey, _delta, "BUCKET", 1000)
+	if mustParseDecimal(v.(string)).Cmp(_apdDelta) < 0 {
+		panic("ts.add")
+	}
+}
+
+func cmdIdempotent(client *redis.Client) {
+	// The retry must reply with the first result and not add _delta again.
+	id := strconv.FormatInt(rand.Int63(), 36)
+	v := doCmd(client, "bn.incrby", _idemKey, _delta, "IDEMPOTENCY", id)
+	if doCmd(client, "bn.incrby", _idemKey, _delta, "IDEMPOTENCY", id) != v {
+		panic("idempotency")
+	}
+
+	_apdLock.Lock()
+	defer _apdLock.Unlock()
+	_apdCtx.Add(_apdIdem, _apdIdem, _apdDelta)
+}
+
+func cmdSetifgt(client *redis.Client) {
+	// The high-water mark replied is never below the value offered.
+	r := randFloat()
+	v := doCmd(client, "bn.setifgt", _highKey, r)
+	if mustParseDecimal(v.(string)).Cmp(mustParseDecimal(r)) < 0 {
+		panic("setifgt")
+	}
+}
+
+func cmdMigrate(client *redis.Client) {
+	// A plain string converted to the native type keeps its value.
+	r := randFloat()
+	key := "migrate:" + r
+	doCmd(client, "set", key, r)
+	doCmd(client, "bn.migrate", "key", key)
+	v := doCmd(client, "bn.get", key)
+	doCmd(client, "del", key)
+	if mustParseDecimal(v.(string)).Cmp(mustParseDecimal(r)) != 0 {
+		panic("migrate")
+	}
+}
+
+func cmdTransfer(client *redis.Client) {
+	v := doCmd(client, "bn.transfer", _srcKey, _dstKey, _delta).([]interface{})
+	if len(v) != 2 {
+		panic("transfer")
+	}
+
+	_apdLock.Lock()
+	defer _apdLock.Unlock()
+	_apdCtx.Sub(_apdSrc, _apdSrc, _apdDelta)
+	_apdCtx.Add(_apdDst, _apdDst, _apdDelta)
+}
+
 func loop(cmd func(client *redis.Client)) {
 	_wg.Add(1)
 	defer _wg.Done()
@@ -288,6 +470,10 @@ func bench() {
 		{OpSUB, "OpSUB", cmdSub},
 		{OpMUL, "OpMUL", cmdMul},
 		{OpDIV, "OpDIV", cmdDiv},
+		{OpSUM, "OpSUM", cmdSum},
+		{OpPRODUCT, "OpPRODUCT", cmdProduct},
+		{OpVADD, "OpVADD", cmdVadd},
+		{OpVMUL, "OpVMUL", cmdVmul},
 		{OpABS, "OpABS", cmdABS},
 		{OpTO_FIXED, "OpTO_FIXED", cmdToFixed},
 		{OpINCR, "OpINCR", cmdIncr},
@@ -300,6 +486,18 @@ func bench() {
 		{OpHINCRBY, "OpHINCRBY", cmdHincrby},
 		{OpHDECRBY, "OpHDECRBY", cmdHdecrby},
 		{OpHRANDOM, "OpHRANDOM", cmdHrandom},
+		{OpMINCRBY, "OpMINCRBY", cmdMincrby},
+		{OpHMINCRBY, "OpHMINCRBY", cmdHmincrby},
+		{OpZINCRBY, "OpZINCRBY", cmdZincrby},
+		{OpBOUNDED, "OpBOUNDED", cmdBounded},
+		{OpTRANSFER, "OpTRANSFER", cmdTransfer},
+		{OpEVAL, "OpEVAL", cmdEval},
+		{OpWAITUNTIL, "OpWAITUNTIL", cmdWaituntil},
+		{OpLEDGER, "OpLEDGER", cmdLedger},
+		{OpTSADD, "OpTSADD", cmdTsAdd},
+		{OpIDEMPOTENT, "OpIDEMPOTENT", cmdIdempotent},
+		{OpSETIFGT, "OpSETIFGT", cmdSetifgt},
+		{OpMIGRATE, "OpMIGRATE", cmdMigrate},
 	}
 
 	for i := 0; i < *_clients; i++ {
@@ -313,12 +511,22 @@ func report(elapsed time.Duration) {
 	client := redis.NewClient(_redisOpts)
 	defer client.Close()
 
-	log.Printf("key=%s redis=%s apd=%s", _radixKey, client.Get(_radixKey).Val(), _apdRadix.String())
-	log.Printf("key=%s redis=%s apd=%s", _fracKey, client.Get(_fracKey).Val(), _apdFrac.String())
-	log.Printf("key=%s redis=%s apd=%s", _randomKey, client.Get(_randomKey).Val(), _apdRandom.String())
-	log.Printf("key=%s[%s] redis=%s apd=%s", _hashKey, _radixKey, client.HGet(_hashKey, _radixKey).Val(), _apdHashRadix.String())
-	log.Printf("key=%s[%s] redis=%s apd=%s", _hashKey, _fracKey, client.HGet(_hashKey, _fracKey).Val(), _apdHashFrac.String())
-	log.Printf("key=%s[%s] redis=%s apd=%s", _hashKey, _randomKey, client.HGet(_hashKey, _randomKey).Val(), _apdHashRandom.String())
+	// Counters are native bignumber keys, plain GET can't read them.
+	log.Printf("key=%s redis=%v apd=%s", _radixKey, doCmd(client, "bn.get", _radixKey), _apdRadix.String())
+	log.Printf("key=%s redis=%v apd=%s", _fracKey, doCmd(client, "bn.get", _fracKey), _apdFrac.String())
+	log.Printf("key=%s redis=%v apd=%s", _randomKey, doCmd(client, "bn.get", _randomKey), _apdRandom.String())
+	log.Printf("key=%s[%s] redis=%v apd=%s", _hashKey, _radixKey, doCmd(client, "bn.hget", _hashKey, _radixKey), _apdHashRadix.String())
+	log.Printf("key=%s[%s] redis=%v apd=%s", _hashKey, _fracKey, doCmd(client, "bn.hget", _hashKey, _fracKey), _apdHashFrac.String())
+	log.Printf("key=%s[%s] redis=%v apd=%s", _hashKey, _randomKey, doCmd(client, "bn.hget", _hashKey, _randomKey), _apdHashRandom.String())
+	hashSum := mustParseDecimal("0")
+	_apdCtx.Add(hashSum, _apdHashRadix, _apdHashFrac)
+	_apdCtx.Add(hashSum, hashSum, _apdHashRandom)
+	log.Printf("key=%s[*] sum redis=%v apd=%s", _hashKey, doCmd(client, "bn.hsum", _hashKey), hashSum.String())
+	log.Printf("key=%s redis=%v apd=%s", _srcKey, doCmd(client, "bn.get", _srcKey), _apdSrc.String())
+	log.Printf("key=%s redis=%v apd=%s", _dstKey, doCmd(client, "bn.get", _dstKey), _apdDst.String())
+	log.Printf("key=%s redis=%v apd=%s", _idemKey, doCmd(client, "bn.get", _idemKey), _apdIdem.String())
+	log.Printf("key=%s redis=%v apd=%s", _ledgerKey, doCmd(client, "bn.ledger.balance", _ledgerKey), _apdLedger.String())
+	log.Printf("key=%s[%s] redis=%v apd=%s", _zsetKey, _randomKey, doCmd(client, "bn.zscore", _zsetKey, _randomKey), _apdZsetRandom.String())
 
 	count := atomic.LoadInt64(&_count)
 	qps := float64(count) / elapsed.Seconds()